@@ -5,6 +5,8 @@
 
 #include <string>
 #include <map>
+#include <vector>
+#include <algorithm>
 #include <iostream>
 #include <iomanip>  // setw
 #include <string.h>
@@ -52,12 +54,14 @@ void Atom::parseHeader(FileRead &file, bool no_check) {
 }
 
 bool isValidAtomName(const uchar* buff) {
+	static const vector<uint> names = []() {  // sorted fourccs, native byte order
+		vector<uint> v;
+		for (int i = 0; i < numKnownAtoms; i++) v.push_back(*(uint*)knownAtoms[i].known_atom_name);
+		sort(v.begin(), v.end());
+		return v;
+	}();
 	if (!isdigit(*buff) && !islower(*buff)) return false;
-	for(int i = 0; i < numKnownAtoms; i++)
-		if (strncmp((char*)buff, knownAtoms[i].known_atom_name, 4) == 0) {
-			return true;
-		}
-	return false;
+	return binary_search(names.begin(), names.end(), *(uint*)buff);
 }
 
 bool isPointingAtAtom(FileRead& file) {
@@ -143,15 +147,23 @@ void Atom::findAtomNames(const string& filename) {
 }
 
 void Atom::write(FileWrite &file) {
-	int start = file.pos();
+	vector<uchar> buf;
+	buf.reserve(length_);
+	serialize(buf);
+	file.write(buf);
+}
+
+void Atom::serialize(vector<uchar>& out) const {
+	size_t start = out.size();
 
-	file.writeInt(length_);
-	file.writeChar(name_.data(), 4);
-	file.write(content_);
+	uint len = swap32(length_);
+	out.insert(out.end(), (uchar*)&len, (uchar*)&len + 4);
+	out.insert(out.end(), name_.begin(), name_.begin() + 4);
+	out.insert(out.end(), content_.begin(), content_.end());
 	for (uint i=0; i < children_.size(); i++)
-		children_[i]->write(file);
-	int end = file.pos();
-	assert(end - start == length_);
+		children_[i]->serialize(out);
+
+	assert(to_int64(out.size() - start) == length_, name_, out.size() - start, length_);
 }
 
 void Atom::print(int offset) {
@@ -256,16 +268,18 @@ void Atom::print(int offset) {
 }
 
 AtomDefinition definition(const string& id) {
-	static map<string, AtomDefinition> def;
-	if(def.size() == 0) {
+	static const map<string, AtomDefinition> def = []() {  // atoms are parsed on several threads
+		map<string, AtomDefinition> m;
 		for(int i = 0; i < numKnownAtoms; i++)
-			def[knownAtoms[i].known_atom_name] = knownAtoms[i];
-	}
-	if(!def.count(id)) {
+			m[knownAtoms[i].known_atom_name] = knownAtoms[i];
+		return m;
+	}();
+	auto it = def.find(id);
+	if(it == def.end()) {
 		//return a fake definition
-		return def["<()>"];
+		return def.at("<()>");
 	}
-	return def[id];
+	return it->second;
 }
 
 bool Atom::isParent(const string& id) {
@@ -450,18 +464,31 @@ void BufferedAtom::write(FileWrite &output, bool force_64) {
 
 	off_t offset = 0;
 	int loop_cnt = 0;
+	auto report = [&](bool now=false) {  // every 10th buffer or kept range
+		if (name_ != "mdat" || (!now && loop_cnt++ < 10)) return;
+		loop_cnt = 0;
+		chkCancelled();
+		if (g_log_mode == I) outProgress(offset, contentSize());
+	};
+	const off_t kKernelCopyChunk = 64<<20;
 	while (offset < contentSize()) {
-		if (name_ == "mdat" && g_log_mode == I && loop_cnt++ >= 10) {
-			outProgress(offset, contentSize());
-			loop_cnt = 0;
+		// the range kept until the next excluded sequence, copied in-kernel if possible
+		off_t end = at_end(to_skip_it) ? contentSize() : min(contentSize(), to_skip_it->first);
+		while (g_kernel_copy && offset < end) {
+			size_t n = min(kKernelCopyChunk, end - offset);
+			size_t done = output.copyFrom(file_read_, contentStart() + offset, n);
+			offset += done;
+			if (done < n) break;
+			report(true);
 		}
-		int toread = file_read_.buf_size_;
-		if (offset + toread > contentSize()) toread = contentSize() - offset;
-		if (!at_end(to_skip_it) && offset + toread > to_skip_it->first) toread = to_skip_it->first - offset;
 
-		auto buff = getFragment(offset, toread);
-		offset += toread;
-		output.writeChar(buff, toread);
+		while (offset < end) {
+			report();
+			int toread = min<off_t>(file_read_.buf_size_, end - offset);
+			output.writeChar(getFragment(offset, toread), toread);
+			offset += toread;
+		}
+		report();
 
 		if (!at_end(to_skip_it) && offset == to_skip_it->first) {
 			logg(V, "skipping ", setfill(' '), left, setw(6), to_skip_it->second, " at ", g_mp4->offToStr(to_skip_it->first), '\n');
@@ -4,6 +4,7 @@ extern "C" {
 #include <stdint.h>
 }
 #include <vector>
+#include <algorithm>
 #include <string>
 
 #include "common.h"
@@ -25,6 +26,7 @@ public:
 	void parseHeader(FileRead &file, bool no_check=false); //read just name and length
 	void parse(FileRead& file);
 	virtual void write(FileWrite &file);
+	void serialize(std::vector<uchar>& out) const;  // appends whole atom
 	void print(int offset);
 
 	std::vector<Atom *> atomsByName(const std::string& name, bool no_recursive=false);
@@ -76,7 +78,7 @@ public:
 
 	explicit BufferedAtom(FileRead&);
 
-	int64_t contentSize() const { return file_end_ - contentStart(); }
+	int64_t contentSize() const { return std::min<int64_t>(file_end_, file_read_.length()) - contentStart(); }
 	const uchar *getFragment(off_t offset, int size);
 
 	const uchar *getFragmentIf(off_t offset, int size) {
@@ -16,8 +16,8 @@ int getSizeAvc1(Codec* self, const uchar* start, uint maxlength) {
 	uint32_t length = 0;
 	const uchar *pos = start;
 
-	static bool sps_info_initialized = false;
-	static SpsInfo sps_info;
+	static thread_local bool sps_info_initialized = false;
+	static thread_local SpsInfo sps_info;
 	if (!sps_info_initialized){
 		logg(V, "sps_info (before): ",
 			sps_info.frame_mbs_only_flag,
@@ -41,7 +41,7 @@ int getSizeAvc1(Codec* self, const uchar* start, uint maxlength) {
 
 	while(1) {
 		logg(V, "---\n");
-		if (self->chk_for_twos_ && Codec::looksLikeTwosOrSowt(pos)) return length;
+		if (self->chk_for_twos_ && Codec::looksLikeTwosOrSowt(pos, self->twos_is_sowt_)) return length;
 		NalInfo nal_info(pos, maxlength);
 		bool was_keyframe = false;
 		if(!nal_info.is_ok){
@@ -85,7 +85,7 @@ int getSizeAvc1(Codec* self, const uchar* start, uint maxlength) {
 			break;
 		}
 		case NAL_FILLER_DATA:
-			if (g_log_mode >= V) {
+			if (logEnabled(V)) {
 				logg(V, "found filler data: ");
 				printBuffer(pos, 30);
 			}
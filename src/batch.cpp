@@ -0,0 +1,89 @@
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <tuple>
+#include <iomanip>
+
+#include "mp4.h"
+#include "file.h"
+#include "common.h"
+
+using namespace std;
+
+/* Several corrupt files: the healthy file is analyzed once, then a pool of threads
+   repairs one file after another. Each file gets its own Mp4, cloned from this one
+   (see cloneAnalyzed), and is scanned single-threaded. Fatal errors only fail that file.
+*/
+bool Mp4::repairBatch(const vector<string>& filenames) {
+	for (auto& fn : filenames)
+		if (fn == "-") logg(ET, "stdin can't be repaired along with other files\n");
+	if (g_dst_path.size() && !isdir(g_dst_path))
+		logg(ET, "'-dst' has to be a directory when repairing several files\n");
+	if (chkBadFFmpegVersion()) return false;
+
+	prepareRepair();  // the analysis happens here, only once
+	uint n = g_threads > 1 ? g_threads : max(1u, thread::hardware_concurrency());
+	n = min<size_t>(n, filenames.size());
+	logg(I, "repairing ", filenames.size(), " files with ", n, " threads ...\n");
+
+	auto saved = make_tuple(g_log_mode, g_interactive, g_throw_fatal);
+	g_log_mode = min(g_log_mode, E);
+	g_interactive = false;
+	g_throw_fatal = true;
+	bool was_muted = g_muted;
+	if (!was_muted) mute();
+
+	auto repairOne = [&](const string& fn) -> string {
+		if (alreadyRepaired(filename_ok_, fn)) return "already repaired";
+		auto w = repairCopy(fn, true);
+		auto r = ss(w->pkt_idx_, " samples");
+		if (w->premature_end_) r += ss(", premature end at ", setprecision(3), w->premature_percentage_, "%");
+		return r;
+	};
+
+	vector<string> errors(filenames.size());
+	atomic<size_t> next(0);
+	size_t finished = 0;
+	mutex out_mutex;
+	Options opts;
+	auto work = [&]() {
+		opts.apply();
+		for (size_t i; (i = next++) < filenames.size();) {
+			string result;
+			g_mp4 = this;  // might point to the last, destroyed worker
+			try {
+				result = repairOne(filenames[i]);
+			}
+			catch (const exception& e) { errors[i] = e.what(); }
+			catch (const string& e) { errors[i] = e; }
+			catch (const char* e) { errors[i] = e; }
+			if (errors[i].size()) {
+				trim_right(errors[i]);
+				result = "failed: " + errors[i];
+			}
+
+			lock_guard<mutex> lock(out_mutex);
+			cout << "[" << ++finished << "/" << filenames.size() << "] " << filenames[i] << ": " << result << '\n';
+		}
+	};
+	vector<thread> pool;
+	for (uint k=0; k < n; k++) pool.emplace_back(work);
+	for (auto& t : pool) t.join();
+
+	tie(g_log_mode, g_interactive, g_throw_fatal) = saved;
+	if (!was_muted) unmute();
+
+	size_t n_failed = count_if(errors.begin(), errors.end(), [](const string& e) { return e.size(); });
+	logg(I, filenames.size() - n_failed, " of ", filenames.size(), " files repaired\n");
+	return !n_failed;
+}
+
+// repairs with a clone of this, after prepareRepair(). Can run on several threads at once.
+unique_ptr<Mp4> Mp4::repairCopy(const string& filename, bool single_threaded) {
+	auto w = cloneAnalyzed();
+	g_mp4 = w.get();
+	w->single_threaded_ = single_threaded;
+	w->repair(filename);
+	g_mp4 = this;
+	return w;
+}
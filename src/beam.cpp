@@ -0,0 +1,131 @@
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+#include "mp4.h"
+#include "atom.h"
+#include "common.h"
+#include "hvc1/hvc1.h"
+
+using namespace std;
+
+/* '-beam <k>': if a frame could end at several offsets, the k best partial parses
+   starting with each of them are followed over the next few frames.
+   A parse scores for likely sample sizes, for frames that follow it and for
+   track transitions seen in the healthy file. The search ends once all beams
+   start with the same size, or after max(2, track_order_.size()) frames.
+*/
+
+namespace {
+
+constexpr uint kMaxBeamDepth = 8;
+constexpr double kMatchScore = 4, kPatternScore = 2, kNoMatchScore = -8, kMinSizeScore = -8;
+
+struct Beam {
+	int first_size;  // of the frame in question, the result
+	off_t end;
+	int track_idx;  // of the last frame
+	double score;
+	bool done;
+};
+
+// log-likelihood (without constant terms) of a sample size
+double sizeScore(const SampleSizeStats& ss, int sz) {
+	bool have_stats = false;
+	double r = kMinSizeScore;
+	for (auto s : {&ss.normal, &ss.keyframe}) {
+		if (s->n < 2 || s->dev <= 0) continue;
+		have_stats = true;
+		double z = (sz - s->avg) / s->dev;
+		r = max(r, -0.5 * z * z);
+	}
+	return have_stats ? r : 0;
+}
+
+bool isHvc1(const Codec& c) { return c.name_ == "hvc1" || c.name_ == "hev1"; }
+
+}  // namespace
+
+int Mp4::beamSearchSize(Codec* self, const vector<int>& sizes) {
+	if (amInFreeSequence() || self->track_idx_ < 0) return sizes.back();
+	off_t off = self->cur_off_;
+	auto content_size = current_mdat_->contentSize();
+
+	auto addFollowing = [&](const Beam& b, vector<Beam>& out) {
+		if (b.done) {
+			out.push_back(b);
+			return;
+		}
+		if (b.end == content_size) {  // a clean end is as good as a match
+			out.push_back({b.first_size, b.end, b.track_idx, b.score + kMatchScore, true});
+			return;
+		}
+		auto buf = current_mdat_->getFragmentIf(b.end, min<int64_t>(1024, content_size - b.end));
+		if (!buf || content_size - b.end < 16) {
+			out.push_back({b.first_size, b.end, b.track_idx, b.score + kNoMatchScore, true});
+			return;
+		}
+
+		int next_idx = -1;
+		auto cand = candidateTracks(buf);
+		for (uint i=0; i < tracks_.size(); i++) {
+			if (i < 64 && !(cand >> i & 1)) continue;
+			if (tracks_[i].codec_.matchSample(buf)) {
+				next_idx = i;
+				break;
+			}
+		}
+		if (next_idx < 0) {
+			out.push_back({b.first_size, b.end, b.track_idx, b.score + kNoMatchScore, true});
+			return;
+		}
+
+		double score = b.score + kMatchScore;
+		if (next_idx != b.track_idx && using_dyn_patterns_ && anyPatternMatchesHalf(b.end, next_idx))
+			score += kPatternScore;
+
+		auto& t = tracks_[next_idx];
+		vector<int> next_sizes;
+		if (t.constant_size_ > 0) next_sizes.push_back(t.constant_size_);
+		else if (isHvc1(t.codec_)) {
+			uint maxlength = min<int64_t>(max_part_size_, content_size - b.end);
+			next_sizes = getLengthsHvc1(&t.codec_, b.end, maxlength);
+		}
+
+		if (next_sizes.empty()) {  // size unknown without decoding, stop here
+			out.push_back({b.first_size, b.end, next_idx, score, true});
+			return;
+		}
+		for (auto sz : next_sizes) {
+			off_t end = b.end + t.alignPktLength(sz);
+			if (end > content_size) continue;
+			out.push_back({b.first_size, end, next_idx, score + sizeScore(t.ss_stats_, sz), false});
+		}
+	};
+
+	auto& t = tracks_[self->track_idx_];
+	vector<Beam> beams;
+	for (auto sz : sizes) {
+		off_t end = off + t.alignPktLength(sz);
+		if (end <= content_size) beams.push_back({sz, end, self->track_idx_, sizeScore(t.ss_stats_, sz), false});
+	}
+	if (beams.empty()) return sizes.back();
+
+	auto byScore = [](const Beam& a, const Beam& b) { return a.score > b.score; };
+	uint depth = min<size_t>(kMaxBeamDepth, max<size_t>(2, track_order_.size()));
+	for (uint d=0; d < depth; d++) {
+		vector<Beam> next;
+		for (auto& b : beams) addFollowing(b, next);
+		sort(next.begin(), next.end(), byScore);
+		if (next.size() > g_beam_width) next.resize(g_beam_width);
+		beams = move(next);
+
+		bool converged = all_of(beams.begin(), beams.end(), [&](const Beam& b) { return b.first_size == beams[0].first_size; });
+		bool all_done = all_of(beams.begin(), beams.end(), [](const Beam& b) { return b.done; });
+		if (converged || all_done) break;
+	}
+
+	auto& best = *min_element(beams.begin(), beams.end(), byScore);
+	logg(V, "beamSearchSize(", offToStr(off), "): ", best.first_size, " of ", sizes.size(), " candidates (score ", best.score, ")\n");
+	return best.first_size;
+}
@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <time.h>
+
+#include "mp4.h"
+#include "atom.h"
+#include "file.h"
+#include "common.h"
+#include "checkpoint.h"
+
+using namespace std;
+
+/* The scan state is saved every kCheckpointInterval seconds to <output>.ckpt, at a frame boundary.
+   '-resume' loads it and continues from there. Decoder state is not saved,
+   so decoding restarts at the checkpoint like at the beginning of an mdat.
+   Only sequential scans are saved, '-j' and files with several mdats can't be resumed.
+*/
+
+namespace {
+constexpr time_t kCheckpointInterval = 60;
+constexpr uint32_t kCheckpointVersion = 3;
+const string kCheckpointMagic = "untrunc-ckpt";
+}
+
+// the file and tracks the saved state belongs to
+string Mp4::indexKey() {
+	string r = ss(current_mdat_->file_read_.length(), " ", current_mdat_->contentStart(), " ",
+	              current_mdat_->contentSize());
+	for (auto& t : tracks_) r += " " + t.codec_.name_;
+	return r;
+}
+
+// everything the saved state depends on
+string Mp4::checkpointKey() {
+	string r = ss(indexKey(), " ", max_part_size_, " ", g_ignore_unknown, " ",
+	              Mp4::step_, " ", g_use_chunk_stats, " ", g_dont_exclude, " ", g_beam_width, " ",
+	              from_profile_, " ", myBasename(filename_ok_));
+	for (auto& ref : refs_) r += " " + myBasename(ref->filename_ok_);
+	return r;
+}
+
+// what the scan found so far
+void Mp4::putScanResults(BinWriter& w) {
+	w.put(pkt_idx_);
+	w.put(atoms_skipped_);
+	w.put(unknown_seqs_);
+	w.put(current_mdat_->sequences_to_exclude_);
+	w.put(current_mdat_->total_excluded_yet_);
+
+	for (auto& t : tracks_) {
+		w.put(t.sizes_);
+		w.put(t.times_);
+		w.put(t.keyframes_);
+		w.put(t.num_samples_);
+		w.put(t.chunks_);
+	}
+}
+
+void Mp4::getScanResults(BinReader& r) {
+	r.get(pkt_idx_);
+	r.get(atoms_skipped_);
+	r.get(unknown_seqs_);
+	r.get(current_mdat_->sequences_to_exclude_);
+	r.get(current_mdat_->total_excluded_yet_);
+
+	for (auto& t : tracks_) {
+		r.get(t.sizes_);
+		r.get(t.times_);
+		r.get(t.keyframes_);
+		r.get(t.num_samples_);
+		r.get(t.chunks_);
+	}
+}
+
+void Mp4::maybeCheckpoint(off_t offset) {
+	if (ckpt_path_.empty() || unknown_length_ || ckpt_cnt_++ % 4096) return;
+	auto now = time(nullptr);
+	if (!ckpt_last_) ckpt_last_ = now;
+	if (now - ckpt_last_ < kCheckpointInterval) return;
+	ckpt_last_ = now;
+	saveCheckpoint(offset);
+}
+
+void Mp4::saveCheckpoint(off_t offset) {
+	BinWriter w;
+	w.put(kCheckpointMagic);
+	w.put(kCheckpointVersion);
+	w.put(checkpointKey());
+
+	w.put(offset);
+	w.put(last_track_idx_);
+	w.put(done_padding_);
+	w.put(done_padding_after_);
+	w.put(next_chunk_idx_);
+	w.put(ignored_chunk_order_);
+	w.put(first_chunk_found_);
+	for (auto& t : tracks_) {
+		w.put(t.current_chunk_);
+		w.put(t.predictable_start_cnt_);
+		w.put(t.unpredictable_start_cnt_);
+	}
+	putScanResults(w);
+
+	if (!writeFileAtomically(ckpt_path_, w.buf_)) {
+		logg(W, "could not write checkpoint '", ckpt_path_, "', disabling checkpoints\n");
+		ckpt_path_.clear();
+		return;
+	}
+	logg(V, "checkpoint at ", offToStr(offset), " (", pretty_bytes(w.buf_.size()), ")\n");
+}
+
+bool Mp4::loadCheckpoint(off_t& offset) {
+	vector<uchar> data;
+	if (!readWholeFile(ckpt_path_, data)) {
+		logg(W, "no checkpoint found at '", ckpt_path_, "', starting from the beginning\n");
+		return false;
+	}
+
+	try {
+		BinReader r(data.data(), data.size());
+		if (r.get<string>() != kCheckpointMagic || r.get<uint32_t>() != kCheckpointVersion)
+			throw string("unknown format");
+		if (r.get<string>() != checkpointKey())
+			throw string("it was made for a different file or with different options");
+
+		r.get(offset);
+		r.get(last_track_idx_);
+		r.get(done_padding_);
+		r.get(done_padding_after_);
+		r.get(next_chunk_idx_);
+		r.get(ignored_chunk_order_);
+		r.get(first_chunk_found_);
+		for (auto& t : tracks_) {
+			r.get(t.current_chunk_);
+			r.get(t.predictable_start_cnt_);
+			r.get(t.unpredictable_start_cnt_);
+		}
+		getScanResults(r);
+		if (!r.atEnd()) throw string("trailing data");
+	}
+	catch (const string& e) {
+		logg(ET, "can't resume from '", ckpt_path_, "': ", e, "\n");
+	}
+
+	logg(I, "resuming at ", offToStr(offset), " (", pkt_idx_, " samples restored)\n");
+	return true;
+}
+
+void Mp4::removeCheckpoint() {
+	if (!ckpt_path_.empty()) remove(ckpt_path_.c_str());
+}
+
+bool readWholeFile(const string& path, vector<uchar>& data) {
+	FILE* f = my_open(path.c_str(), "rb");
+	if (!f) return false;
+	data.clear();
+	uchar tmp[1<<16];
+	for (size_t n; (n = fread(tmp, 1, sizeof(tmp), f)) > 0;) data.insert(data.end(), tmp, tmp + n);
+	bool ok = !ferror(f);
+	fclose(f);
+	return ok;
+}
+
+bool writeFileAtomically(const string& path, const vector<uchar>& data) {
+	auto tmp = path + ".tmp";
+	FILE* f = my_open(tmp.c_str(), "wb");
+	bool ok = f && fwrite(data.data(), 1, data.size(), f) == data.size();
+	if (f) ok = !fclose(f) && ok;
+#ifdef _WIN32
+	if (ok) remove(path.c_str());  // rename does not replace
+#endif
+	if (!ok || rename(tmp.c_str(), path.c_str())) {
+		remove(tmp.c_str());
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <string.h>
+#include <type_traits>
+
+#include "common.h"
+
+// compact native-endian serialization, for '-resume' checkpoints and profiles
+class BinWriter {
+public:
+	std::vector<uchar> buf_;
+
+	template<class T>
+	void put(const T& x) {
+		static_assert(std::is_trivially_copyable<T>::value, "use a specialized put");
+		auto p = (const uchar*) &x;
+		buf_.insert(buf_.end(), p, p + sizeof(T));
+	}
+	void put(const std::string& s) {
+		put<uint64_t>(s.size());
+		buf_.insert(buf_.end(), s.begin(), s.end());
+	}
+	template<class T>
+	void put(const std::vector<T>& v) {
+		put<uint64_t>(v.size());
+		for (auto& x : v) put(x);
+	}
+	template<class A, class B>
+	void put(const std::pair<A, B>& p) {
+		put(p.first);
+		put(p.second);
+	}
+};
+
+class BinReader {
+public:
+	BinReader(const uchar* data, size_t n) : p_(data), end_(data + n) {}
+
+	template<class T>
+	void get(T& x) {
+		static_assert(std::is_trivially_copyable<T>::value, "use a specialized get");
+		need(sizeof(T));
+		memcpy(&x, p_, sizeof(T));
+		p_ += sizeof(T);
+	}
+	void get(std::string& s) {
+		auto n = getSize();
+		need(n);
+		s.assign((const char*) p_, n);
+		p_ += n;
+	}
+	template<class T>
+	void get(std::vector<T>& v) {
+		v.resize(getSize());
+		for (auto& x : v) get(x);
+	}
+	template<class A, class B>
+	void get(std::pair<A, B>& p) {
+		get(p.first);
+		get(p.second);
+	}
+	template<class T>
+	T get() { T x; get(x); return x; }
+
+	bool atEnd() const { return p_ == end_; }
+
+private:
+	const uchar *p_, *end_;
+	void need(size_t n) { if (to_size_t(end_ - p_) < n) throw std::string("data is truncated"); }
+	size_t getSize() {
+		auto n = get<uint64_t>();
+		if (n > to_size_t(end_ - p_)) throw std::string("data is corrupt");
+		return n;
+	}
+};
+
+bool readWholeFile(const std::string& path, std::vector<uchar>& data);
+bool writeFileAtomically(const std::string& path, const std::vector<uchar>& data);  // via <path>.tmp
@@ -23,9 +23,10 @@ using namespace std;
 
 extern map<string, bool(*) (Codec*, const uchar*, uint)> dispatch_match;
 extern map<string, bool(*) (Codec*, const uchar*, uint)> dispatch_strict_match;
+extern map<string, CodecSig> dispatch_sig;
+extern map<string, CodecSig> dispatch_strict_sig;
 extern map<string, int(*) (Codec*, const uchar*, uint)> dispatch_get_size;
 
-bool Codec::twos_is_sowt = false;
 Codec::Codec(AVCodecParameters* c) : av_codec_params_(c) {}
 
 void Codec::initAVCodec() {
@@ -61,6 +62,7 @@ void Codec::initOnce() {
 		for (auto& alias : p.second) {
 			dispatch_get_size[alias] = dispatch_get_size[p.first];
 			dispatch_match[alias] = dispatch_match[p.first];
+			if (dispatch_sig.count(p.first)) dispatch_sig[alias] = dispatch_sig[p.first];
 		}
 	}
 }
@@ -92,6 +94,8 @@ void Codec::parseOk(Atom *trak) {
 
 	match_fn_ = dispatch_match[name_];
 	match_strict_fn_ = dispatch_strict_match[name_];
+	if (dispatch_sig.count(name_)) sig_ = dispatch_sig[name_];
+	strict_sig_ = dispatch_strict_sig.count(name_) ? dispatch_strict_sig[name_] : sig_;
 	get_size_fn_ = dispatch_get_size[name_];
 
 	if (name_ == "avc1") {
@@ -101,8 +105,6 @@ void Codec::parseOk(Atom *trak) {
 		else
 			logg(V, "avcC got decoded\n");
 	}
-	else if (name_ == "sowt")
-		Codec::twos_is_sowt = true;
 }
 
 bool Codec::isSupported() {
@@ -154,8 +156,8 @@ bool Codec::matchSampleStrict(const uchar *start) {
 	return match_strict_fn_(this, start, s);
 }
 
-bool Codec::looksLikeTwosOrSowt(const uchar* start) {
-	if (Codec::twos_is_sowt) start += 1;
+bool Codec::looksLikeTwosOrSowt(const uchar* start, bool is_sowt) {
+	if (is_sowt) start += 1;
 	int
 	    d1 = abs(start[4]  - start[2]),
 	    d2 = abs(start[6]  - start[4]),
@@ -170,8 +172,8 @@ bool Codec::looksLikeTwosOrSowt(const uchar* start) {
 	    (8 < d5 && d5 < 0xf0);
 //	if (cnt <= 1) {
 	if (cnt == 0) {
-		if (g_log_mode >= LogMode::V) {
-			if (Codec::twos_is_sowt) start -= 1;
+		if (logEnabled(V)) {
+			if (is_sowt) start -= 1;
 			printBuffer(start, 16);
 			cout << "avc1: detected sowt..\n";
 		}
@@ -190,7 +192,7 @@ map<string, bool(*) (Codec*, const uchar*, uint)> dispatch_match {
 		return true;
 #endif
 
-		if (self->chk_for_twos_ && Codec::looksLikeTwosOrSowt(start)) return false;
+		if (self->chk_for_twos_ && Codec::looksLikeTwosOrSowt(start, self->twos_is_sowt_)) return false;
 
 		//TODO use the first byte of the nal: forbidden bit and type!
 		int nal_type = (start[4] & 0x1f);
@@ -336,6 +338,50 @@ map<string, bool(*) (Codec*, const uchar*, uint)> dispatch_match {
 	*/
 };
 
+CodecSig::CodecSig(const string& hex, const string& first_bytes) : first_bytes_(first_bytes) {
+	int shift = 56;
+	for (size_t i=0; i < hex.size() && shift >= 0; i += 3, shift -= 8) {
+		auto byte = hex.substr(i, 2);
+		if (byte == "..") continue;
+		mask_ |= 0xffULL << shift;
+		value_ |= stoull(byte, nullptr, 16) << shift;
+	}
+}
+
+bool CodecSig::allowsFirst(uchar b) const {
+	if (none_) return false;
+	if (mask_ >> 56 && (value_ >> 56) != b) return false;
+	return first_bytes_.empty() || first_bytes_.find((char)b) != string::npos;
+}
+
+bool CodecSig::matches(const uchar* start) const {
+	return allowsFirst(start[0]) && (swap64(*(uint64_t*)start) & mask_) == value_;
+}
+
+// keep in sync with dispatch_match and dispatch_strict_match, codecs without entry match anything
+map<string, CodecSig> dispatch_sig {
+	{"avc1", CodecSig("00")},
+	{"hvc1", CodecSig("00 .. .. .. .. 01")},
+	{"fdsc", CodecSig("47 50")},  // "GP"
+	{"mp4v", CodecSig("00 00 01")},
+	{"alac", CodecSig("00 00 .. 00")},
+	{"samr", CodecSig("3c")},
+	{"apcn", CodecSig("69 63 70 66")},  // "icpf"
+	{"sawb", CodecSig("44")},
+	{"gpmd", CodecSig("", "DSRUTE")},  // first letter of the fourccs
+	{"mebx", CodecSig("00 00 00")},
+	{"icod", CodecSig("01 16")},
+	{"ap4x", CodecSig(".. .. .. .. 69 63 70 66")},
+	{"jpeg", CodecSig("ff d8")},
+};
+
+// only where tighter than dispatch_sig
+map<string, CodecSig> dispatch_strict_sig {
+	{"avc1", CodecSig("00 00")},
+	{"mp4a", CodecSig::none()},
+	{"mebx", CodecSig::none()},
+};
+
 bool Codec::matchSample(const uchar *start) {
 	if (match_fn_) {
 		int s = swap32(*(int *)start);  // big endian
@@ -361,9 +407,9 @@ map<string, int(*) (Codec*, const uchar*, uint maxlength)> dispatch_get_size {
 	GET_SZ_FN("mp4a") {
 		maxlength = min(g_max_buf_sz_needed, maxlength);
 
-		static AVPacket* packet = av_packet_alloc();
+		static thread_local AVPacket* packet = av_packet_alloc();
 //		packet->size = g_max_partsize;
-		static AVFrame* frame = av_frame_alloc();
+		static thread_local AVFrame* frame = av_frame_alloc();
 
 		packet->data = const_cast<uchar*>(start);
 		packet->size = maxlength;
@@ -422,14 +468,13 @@ map<string, int(*) (Codec*, const uchar*, uint maxlength)> dispatch_get_size {
 	GET_SZ_FN("fdsc") {  // GoPro recovery
 		// TODO: How is this track used for recovery?
 
-		static int fdsc_idx_ = -1;
-		fdsc_idx_++;
-		if (fdsc_idx_ == 0) {
+		int fdsc_idx = ++self->fdsc_idx_;
+		if (fdsc_idx == 0) {
 			for(auto pos=start+4; maxlength; pos+=4, maxlength-=4) {
 				if (string((char*)pos, 2) == "GP") return pos-start;
 			}
 		}
-		else if (fdsc_idx_ == 1) return g_mp4->getTrack("fdsc").getOrigSize(1);  // probably 152 ?
+		else if (fdsc_idx == 1) return g_mp4->getTrack("fdsc").getOrigSize(1);  // probably 152 ?
 		return 16;
 	}},
 	GET_SZ_FN("gpmd") {  // GoPro meta data, see 'gopro/gpmf-parser'
@@ -438,8 +483,8 @@ map<string, int(*) (Codec*, const uchar*, uint maxlength)> dispatch_get_size {
 		return num + 8;
 	}},
 	GET_SZ_FN("mp4v") {
-		static AVPacket* packet = av_packet_alloc();
-		static AVFrame* frame = av_frame_alloc();
+		static thread_local AVPacket* packet = av_packet_alloc();
+		static thread_local AVFrame* frame = av_frame_alloc();
 
 		packet->data = const_cast<uchar*>(start);
 		maxlength = min(g_max_buf_sz_needed, maxlength);
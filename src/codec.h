@@ -25,6 +25,19 @@ class AvcConfig;
 struct SampleSizeStats;
 struct Track;
 
+// necessary condition of a codec's match functions, checked on the first 8 bytes
+struct CodecSig {
+	CodecSig() = default;
+	CodecSig(const std::string& hex, const std::string& first_bytes="");  // hex: e.g. "00 .. 01"
+	uint64_t mask_ = 0, value_ = 0;  // big endian
+	std::string first_bytes_;  // allowed values of start[0], empty = any
+	bool none_ = false;  // never matches
+	bool allowsFirst(uchar b) const;
+	bool matches(const uchar* start) const;
+	bool isTrivial() const { return !none_ && !mask_ && first_bytes_.empty(); }
+	static CodecSig none() { CodecSig r; r.none_ = true; return r; }
+};
+
 class Codec {
 public:
 	Codec() = default;
@@ -47,9 +60,12 @@ public:
 	int audio_duration_ = 0;
 	bool should_dump_ = false;  // for debug
 	bool chk_for_twos_ = false;
+	bool twos_is_sowt_ = false;  // of this file, for looksLikeTwosOrSowt
+	int fdsc_idx_ = -1;  // samples seen, per file
 
 	bool matchSampleStrict(const uchar* start);
 	uint strictness_lvl_ = 0;
+	CodecSig sig_, strict_sig_;
 	off_t cur_off_ = 0;
 
 	SampleSizeStats *ss_stats_ = NULL;  // set by onTrackRealloc
@@ -59,10 +75,10 @@ public:
 	void onTrackRealloc(int track_idx_);
 
 	bool isSupported();
+	bool canMatch() const { return match_fn_; }
 	const uchar* loadAfter(off_t offset);
 
-	static bool looksLikeTwosOrSowt(const uchar* start);
-	static bool twos_is_sowt;  // used in looksLikeTwosOrSowt
+	static bool looksLikeTwosOrSowt(const uchar* start, bool is_sowt);
 
 private:
 	bool (*match_fn_)(Codec*, const uchar* start, uint s) = nullptr;
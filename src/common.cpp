@@ -3,7 +3,9 @@
 #include <iostream>
 #include <iomanip>  // setprecision
 #include <sstream>
+#include <string.h>  // memcpy
 #include <cmath>
+#include <mutex>
 #include <unistd.h>
 #ifdef __linux__
 #include <sys/prctl.h>
@@ -30,44 +32,16 @@ const bool has_sawb_bug = false;
 
 using namespace std;
 
-LogMode g_log_mode = LogMode::I;
-//uint g_max_partsize_default = 1600000;  // 1.6MB
-uint g_max_partsize_default = 1<<23;  // 8MiB
-uint g_max_partsize = 0;  // configurable via "-mp"
-uint g_max_buf_sz_needed = 1<<19;  // 512kiB
-bool g_interactive = true;
-bool g_muted = false;
-bool g_ignore_unknown = false;
-bool g_stretch_video = false;
-bool g_show_tracks = false;
-bool g_dont_write = false;
-bool g_use_chunk_stats = false;
-bool g_dont_exclude = false;
-bool g_dump_repaired = false;
-bool g_search_mdat = false;
-bool g_strict_nal_frame_check = true;
-bool g_allow_large_sample = false;
-bool g_ignore_forbidden_nal_bit = false;
-bool g_dont_omit = false;
-bool g_noise_buffer_active = false;
-bool g_ignore_out_of_bound_chunks = false;
-bool g_skip_existing = false;
-bool g_ignore_keyframe_mismatch = false;
-bool g_skip_nal_filler_data = false;
-bool g_rsv_ben_mode = false;
-bool g_off_as_hex = true;
-bool g_fast_assert = false;
-bool g_no_ctts = false;
+#define X(type, name, init) thread_local type name = init;
+UNTR_OPTIONS(X)
+#undef X
 bool g_is_gui = false;
-uint g_num_w2 = 0;
-Mp4* g_mp4 = nullptr;
-void (*g_onProgress)(int) = nullptr;
+bool g_noise_buffer_active = false;
+std::atomic<uint> g_num_w2(0);
+std::atomic<bool> g_muted(false);
+thread_local Mp4* g_mp4 = nullptr;
 void (*g_onStatus)(const string&) = nullptr;
-int64_t g_range_start = kRangeUnset;
-int64_t g_range_end = kRangeUnset;
-std::string g_dst_path;
 
-std::stringstream noise_buffer;
 std::streambuf *orig_cout, *orig_cerr;
 void enableNoiseBuffer();
 void disableNoiseBuffer();
@@ -324,6 +298,35 @@ int64_t gcd(int64_t a, int64_t b) {
 	return b ? gcd(b, a%b) : a;
 }
 
+mutex mem_mutex;
+int64_t mem_used = 0;
+
+size_t memTake(size_t wanted, size_t min_size, const string& what) {
+	lock_guard<mutex> lk(mem_mutex);
+	size_t granted = wanted;
+	if (g_mem_budget) {
+		auto avail = max<int64_t>(0, g_mem_budget - mem_used);
+		granted = max(min<size_t>(wanted, avail), min(min_size, wanted));
+		if (granted < wanted)
+			logg(V, "memory budget: ", what, " gets ", pretty_bytes(granted), " instead of ", pretty_bytes(wanted), '\n');
+		if (mem_used + to_int64(granted) > g_mem_budget)
+			logg(W, "memory budget exceeded by ", what, " (", pretty_bytes(mem_used + granted - g_mem_budget), ")\n");
+	}
+	mem_used += granted;
+	return granted;
+}
+
+void memGive(size_t n) {
+	lock_guard<mutex> lk(mem_mutex);
+	mem_used -= n;
+}
+
+int64_t memAvailable() {
+	lock_guard<mutex> lk(mem_mutex);
+	if (!g_mem_budget) return numeric_limits<int64_t>::max();
+	return g_mem_budget - mem_used;
+}
+
 mt19937& getRandomGenerator() {
 	static std::mt19937 gen = []() {
 		const char* seed_env = std::getenv("UNTRUNC_SEED");
@@ -338,21 +341,58 @@ mt19937& getRandomGenerator() {
 	return gen;
 }
 
-int64_t total_omited = 0;
+// keeps the last bytes written, without ever reallocating
+class RingBuf : public std::streambuf {
+public:
+	void reserve(size_t cap) { buf_.resize(cap); }
+	size_t capacity() const { return buf_.size(); }
+	uint64_t omitted() const { return written_ - size(); }
+	size_t size() const { return std::min<uint64_t>(written_, buf_.size()); }
+	void clear() { written_ = 0; }
+
+	std::string str() const {
+		std::string r;
+		r.reserve(size());
+		size_t head = written_ % buf_.size();
+		if (written_ > buf_.size()) r.append(buf_.data() + head, buf_.size() - head);
+		r.append(buf_.data(), head);
+		return r;
+	}
 
-void cutNoiseBuffer(bool force) {
-	if (noise_buffer.tellp() < 1<<16 && !force) return;
-	auto s = noise_buffer.str();
-	auto off = std::max(0LL, (long long)s.size() - (1<<11));
-	s = s.substr(off);
-	total_omited += off;
-	noise_buffer.str(s);
-	noise_buffer.seekp(0, ios::end);
-}
+protected:
+	std::streamsize xsputn(const char* s, std::streamsize n) override {
+		auto cap = buf_.size();
+		if (to_size_t(n) >= cap) {  // only the tail survives
+			written_ += n - cap;
+			s += n - cap;
+			n = cap;
+		}
+		size_t head = written_ % cap;
+		size_t first = std::min<size_t>(n, cap - head);
+		memcpy(buf_.data() + head, s, first);
+		memcpy(buf_.data(), s + first, n - first);
+		written_ += n;
+		return n;
+	}
+
+	int overflow(int c) override {
+		if (c == EOF) return 0;
+		char ch = c;
+		xsputn(&ch, 1);
+		return c;
+	}
+
+private:
+	std::vector<char> buf_;
+	uint64_t written_ = 0;
+};
+
+RingBuf noise_buffer;
 
 void enableNoiseBuffer() {
-	orig_cout = std::cout.rdbuf(noise_buffer.rdbuf());
-	orig_cerr = std::cerr.rdbuf(noise_buffer.rdbuf());
+	if (!noise_buffer.capacity()) noise_buffer.reserve(memTake(1<<16, 1<<12, "noise buffer"));
+	orig_cout = std::cout.rdbuf(&noise_buffer);
+	orig_cerr = std::cerr.rdbuf(&noise_buffer);
 	g_noise_buffer_active = true;
 }
 
@@ -362,18 +402,19 @@ void disableNoiseBuffer() {
 	std::cerr.rdbuf(orig_cerr);
 	g_noise_buffer_active = false;
 
-	cutNoiseBuffer(true);
 	auto s = noise_buffer.str();
-	auto off = s.find_first_of('\n');
-	if (off != std::string::npos)
-		s = s.substr(off);
-	if (total_omited) {
-		_logg("[[ ", total_omited, " bytes omitted, next ", s.size(), " bytes were buffered ]]\n");
+	auto omitted = noise_buffer.omitted();
+	if (omitted) {  // starts within a line
+		auto off = s.find_first_of('\n');
+		if (off != std::string::npos) {
+			s = s.substr(off);
+			omitted += off;
+		}
+		_logg("[[ ", omitted, " bytes omitted, next ", s.size(), " bytes were buffered ]]\n");
 	}
 	std::cout << s;
 //	cout << "---end_buf\n";
-	noise_buffer.str("");
-	total_omited = 0;
+	noise_buffer.clear();
 }
 
 void warnIfAlreadyExists(const string& output) {
@@ -416,7 +457,7 @@ bool findOrder(vector<pair<int, int>>& data, bool ignore_first_failed) {
 
 	int orig_sz = data.size();
 	data.resize(order_sz);
-	if (g_log_mode >= V) {
+	if (logEnabled(V)) {
 		cout << "first_failed: " << first_failed << " of " << orig_sz << '\n';
 		cout << "order: ";
 		for (auto& p : data) cout << ss("(", p.first, ", ", p.second, ") ");
@@ -446,7 +487,7 @@ vector<int> findOrderSimple(const vector<pair<int, int>>& data) {
 		}
 	}
 
-	if (g_log_mode >= V) {
+	if (logEnabled(V)) {
 		cout << "first_failed: " << first_failed << " of " << data.size() << '\n';
 		cout << "simpleOrder: ";
 		for (auto& x : result) cout << x << " ";
@@ -458,18 +499,20 @@ vector<int> findOrderSimple(const vector<pair<int, int>>& data) {
 }
 
 
-int parseByteStr(string& s) {
+int64_t parseByteStr(string& s) {
+	if (s.empty() || s[0] == '-') logg(ET, "not a size: '", s, "'\n");
 	if (s.back() == 'b') s.pop_back();
 
 	char c = s.back();
-	int f;
+	int64_t f;
 	if (isdigit(c)) f = 1;
 	else if (c == 'k') f = 1<<10;
 	else if (c == 'm') f = 1<<20;
+	else if (c == 'g') f = 1<<30;
 	else { logg(ET, "Error: unkown suffix: ", c, '\n'); }
 
 	if (f > 1) s.pop_back();
-	return f * stoi(s);
+	return f * stoll(s);
 }
 
 void parseMaxPartsize(string& s) {
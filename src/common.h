@@ -8,6 +8,8 @@
 #include <sstream>
 #include <algorithm>
 #include <random>
+#include <atomic>
+#include <stdexcept>
 
 class Mp4;
 
@@ -23,29 +25,80 @@ using offs_t = std::vector<off_t>;
 #define to_uint64(a) static_cast<uint64_t>(a)
 
 enum LogMode { ET, E, W, I, W2, V, VV };
-extern LogMode g_log_mode;
-extern uint
-    g_max_partsize,       // max theoretical part size
-    g_max_buf_sz_needed,  // for determining part size
-    g_max_partsize_default;
-extern bool g_interactive, g_muted, g_ignore_unknown, g_stretch_video,
-    g_show_tracks, g_dont_write, g_use_chunk_stats, g_dont_exclude, g_rsv_ben_mode,
-    g_dump_repaired, g_search_mdat, g_strict_nal_frame_check,
-    g_allow_large_sample,
-    g_ignore_forbidden_nal_bit, g_noise_buffer_active, g_dont_omit,
-    g_ignore_keyframe_mismatch,
-    g_skip_nal_filler_data,
-    g_off_as_hex,
-    g_fast_assert,
-    g_ignore_out_of_bound_chunks, g_skip_existing, g_no_ctts, g_is_gui;
-extern int64_t g_range_start, g_range_end;
-extern std::string g_dst_path;
+using ProgressFn = void (*)(int);
+using LogFn = void (*)(LogMode, const std::string&);
+
+/* Options and callbacks are per thread, so independent repairs can run side by side
+   (see src/lib). Threads started by untrunc copy them from their creator via Options.
+*/
+#define UNTR_OPTIONS(X) \
+	X(LogMode, g_log_mode, LogMode::I) \
+	X(uint, g_max_partsize_default, 1<<23)  /* 8MiB */ \
+	X(uint, g_max_partsize, 0)  /* max theoretical part size, configurable via "-mp" */ \
+	X(uint, g_max_buf_sz_needed, 1<<19)  /* for determining part size */ \
+	X(size_t, g_read_ahead, 0)  /* prefetch depth in bytes, 0 = off */ \
+	X(uint, g_file_windows, 4)  /* buffers per FileRead */ \
+	X(uint, g_threads, 1)  /* '-j', mdat scan workers */ \
+	X(uint, g_beam_width, 0)  /* '-beam', 0 = one-step look-ahead */ \
+	X(bool, g_interactive, true) \
+	X(bool, g_ignore_unknown, false) \
+	X(bool, g_stretch_video, false) \
+	X(bool, g_show_tracks, false) \
+	X(bool, g_dont_write, false) \
+	X(bool, g_use_chunk_stats, false) \
+	X(bool, g_dont_exclude, false) \
+	X(bool, g_dump_repaired, false) \
+	X(bool, g_search_mdat, false) \
+	X(bool, g_strict_nal_frame_check, true) \
+	X(bool, g_allow_large_sample, false) \
+	X(bool, g_ignore_forbidden_nal_bit, false) \
+	X(bool, g_dont_omit, false) \
+	X(bool, g_ignore_out_of_bound_chunks, false) \
+	X(bool, g_skip_existing, false) \
+	X(bool, g_ignore_keyframe_mismatch, false) \
+	X(bool, g_skip_nal_filler_data, false) \
+	X(bool, g_rsv_ben_mode, false) \
+	X(bool, g_off_as_hex, true) \
+	X(bool, g_fast_assert, false) \
+	X(bool, g_no_ctts, false) \
+	X(bool, g_throw_fatal, false)  /* logg(ET, ...) and assert throw instead of exiting */ \
+	X(bool, g_use_mmap, true) \
+	X(bool, g_kernel_copy, true) \
+	X(bool, g_in_place, false) \
+	X(bool, g_direct_io, false) \
+	X(bool, g_resume, false) \
+	X(bool, g_write_index, false) \
+	X(int64_t, g_range_start, kRangeUnset) \
+	X(int64_t, g_range_end, kRangeUnset) \
+	X(int64_t, g_mem_budget, 0)  /* '-mem', 0 = unlimited */ \
+	X(std::string, g_dst_path, "") \
+	X(ProgressFn, g_onProgress, nullptr) \
+	X(LogFn, g_onLog, nullptr)  /* gets the messages instead of stdout */ \
+	X(void*, g_cb_data, nullptr)  /* for whoever set the callbacks */ \
+	X(const std::atomic<bool>*, g_cancel, nullptr)  /* see chkCancelled() */
+
+#define X(type, name, init) extern thread_local type name;
+UNTR_OPTIONS(X)
+#undef X
+
+// the options of the thread it was created on, apply() sets them on another one
+struct Options {
+#define X(type, name, init) type name##_ = name;
+	UNTR_OPTIONS(X)
+#undef X
+	void apply() const {
+#define X(type, name, init) name = name##_;
+		UNTR_OPTIONS(X)
+#undef X
+	}
+};
 
+extern bool g_is_gui, g_noise_buffer_active;
 extern const bool has_sawb_bug;
 extern std::string g_version_str;
-extern uint g_num_w2;  // hidden warnings
-extern Mp4* g_mp4;
-extern void (*g_onProgress)(int);
+extern std::atomic<uint> g_num_w2;  // hidden warnings
+extern std::atomic<bool> g_muted;  // ffmpeg logging is process-wide
+extern thread_local Mp4* g_mp4;  // per scan worker
 extern void (*g_onStatus)(const std::string&);
 
 const int64_t kRangeUnset = std::numeric_limits<int64_t>::min();
@@ -57,7 +110,6 @@ const int64_t kRangeUnset = std::numeric_limits<int64_t>::min();
 	creator{ 0, ( os << (std::forward<decltype(pack)>(pack)), 0) ... }; \
 	_Pragma("GCC diagnostic pop"); \
 
-void cutNoiseBuffer(bool force=false);
 void enableNoiseBuffer();
 void disableNoiseBuffer();
 
@@ -68,9 +120,16 @@ std::string ss(Args&&... args){
 	return ss.str();
 }
 
+// highest level compiled in, see 'make untrunc-prod'
+#ifndef UNTR_MAX_LOG_LEVEL
+#define UNTR_MAX_LOG_LEVEL VV
+#endif
+constexpr LogMode kMaxLogMode = UNTR_MAX_LOG_LEVEL;
+inline bool logEnabled(LogMode lvl) { return lvl <= kMaxLogMode && g_log_mode >= lvl; }
+
 #define logg(lvl, ...) \
 	do { \
-	if (g_log_mode >= lvl) { _logg(lvl, __VA_ARGS__); } \
+	if (logEnabled(lvl)) { _logg(lvl, __VA_ARGS__); } \
 	else if (lvl == W2) {g_num_w2++;} \
 	} while(0)
 
@@ -78,12 +137,16 @@ template<class... Args>
 void _logg(Args&&... args){
 //	(std::cout << ... << args); // Binary left fold (c++17)
 	UNFOLD_PARAM_PACK(args, std::cout);
-
-	if (g_noise_buffer_active) cutNoiseBuffer();
 }
 
 template<class... Args>
 void _logg(LogMode m, Args&&... x){
+	if (g_onLog) {
+		auto msg = ss(x...);
+		g_onLog(m, msg);
+		if (m == ET) throw std::runtime_error(msg);
+		return;
+	}
 	if (m == I)
 		std::cout << "Info: ";
 	else if (m == W || m == W2)
@@ -92,7 +155,7 @@ void _logg(LogMode m, Args&&... x){
 		std::cout << "Error: ";
 		if (m == ET) {
 			_logg(std::forward<Args>(x)...);
-			if (g_is_gui) throw std::runtime_error(ss(std::forward<Args>(x)...));
+			if (g_is_gui || g_throw_fatal) throw std::runtime_error(ss(std::forward<Args>(x)...));
 			else exit(1);
 		}
 	}
@@ -101,7 +164,7 @@ void _logg(LogMode m, Args&&... x){
 
 #define loggF(lvl, ...) \
 	do { \
-	if (g_log_mode >= lvl) { _loggF(lvl, __VA_ARGS__); } \
+	if (logEnabled(lvl)) { _loggF(lvl, __VA_ARGS__); } \
 	else if (lvl == W2) {g_num_w2++;} \
 	} while(0)
 
@@ -184,12 +247,22 @@ const std::map<std::string, std::string> g_atom_names = {
 void mute();
 void unmute();
 
+// large buffers draw from g_mem_budget, they shrink (down to min_size) instead of failing
+size_t memTake(size_t wanted, size_t min_size, const std::string& what);
+void memGive(size_t n);
+int64_t memAvailable();
+
 uint16_t swap16(uint16_t us);
 uint32_t swap32(uint32_t ui);
 uint64_t swap64(uint64_t ull);
 
 void outProgress(double now, double all, const std::string& prefix="");
 
+struct CancelledError : std::runtime_error {
+	CancelledError() : std::runtime_error("cancelled") {}
+};
+inline void chkCancelled() { if (g_cancel && *g_cancel) throw CancelledError(); }
+
 int readGolomb(const uchar *&buffer, int &offset);
 uint readBits(int n, const uchar *&buffer, int &offset);
 
@@ -217,7 +290,7 @@ bool isAllZeros(const uchar* buf, int n);
 bool findOrder(std::vector<std::pair<int, int>>& data, bool ignore_first_failed=false);
 std::vector<int> findOrderSimple(const std::vector<std::pair<int, int>>& data);
 
-int parseByteStr(std::string& s);
+int64_t parseByteStr(std::string& s);
 void parseMaxPartsize(std::string& s);
 
 class Atom;
@@ -268,7 +341,7 @@ void printArgs(std::ostream& os, const std::string& sep, const std::string& argN
 }
 
 
-#define dbgg(msg, ...) if (g_log_mode >= V) __dbgg(msg, #__VA_ARGS__, ##__VA_ARGS__)
+#define dbgg(msg, ...) if (logEnabled(V)) __dbgg(msg, #__VA_ARGS__, ##__VA_ARGS__)
 
 template <typename... Args>
 void __dbgg(const std::string& message, const std::string& argNames, Args... args) {
@@ -292,6 +365,7 @@ void __assertt(const char* expr_str, const char* fn, const char* file, int line,
 
 	printArgs(std::cerr, "  // ", argNames, args...);
 
+	if (g_throw_fatal) throw std::runtime_error(ss("assertion failed: ", expr_str));
 	if (g_fast_assert) exit(1);
 
 	showStacktrace();
@@ -22,48 +22,339 @@
 #include <string>
 #include <cstring>
 #include <iostream>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <limits>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <libgen.h>
+#include <dirent.h>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#endif
 
 #include "common.h"
 
 using namespace std;
 
-FileRead::FileRead(const string& filename) {
-	open(filename);
+// Prefetches the bytes following the last read on a helper thread.
+// Forward jumps restart the stream, backward reads are served synchronously.
+class ReadAhead {
+public:
+	ReadAhead(const string& filename, FILE* sync_file, off_t file_size, size_t depth);
+	~ReadAhead();
+	size_t read(off_t off, uchar* dest, size_t n);
+	static constexpr size_t kMinDepth = 1<<16;
+
+private:
+	struct Block {
+		off_t off;
+		vector<uchar> data;
+	};
+
+	void run();
+	off_t streamBegin() { return blocks_.empty() ? fetch_off_ : blocks_.front().off; }
+	void restartAt(off_t off);
+
+	FILE* file_;  // owned by worker
+	FILE* sync_file_;
+	off_t size_;
+	size_t depth_, block_sz_;
+
+	mutex mtx_;
+	condition_variable cv_;
+	deque<Block> blocks_;
+	size_t queued_ = 0;
+	off_t fetch_off_ = 0;
+	uint64_t gen_ = 0;
+	bool stop_ = false;
+	thread worker_;
+};
+
+ReadAhead::ReadAhead(const string& filename, FILE* sync_file, off_t file_size, size_t depth)
+    : sync_file_(sync_file), size_(file_size), depth_(depth) {
+	file_ = my_open(filename.c_str(), "rb");
+	if (!file_) throw("Could not open file '" + filename + "': " + strerror(errno));
+	depth_ = memTake(max(depth_, kMinDepth), kMinDepth, "read-ahead");
+	block_sz_ = min<size_t>(depth_, 1<<20);
+	worker_ = thread([this, opts = Options()]() { opts.apply(); run(); });
+}
+
+ReadAhead::~ReadAhead() {
+	{
+		lock_guard<mutex> lk(mtx_);
+		stop_ = true;
+	}
+	cv_.notify_all();
+	worker_.join();
+	fclose(file_);
+	memGive(depth_);
+}
+
+void ReadAhead::run() {
+	unique_lock<mutex> lk(mtx_);
+	while (true) {
+		cv_.wait(lk, [&]{ return stop_ || (fetch_off_ < size_ && queued_ < depth_); });
+		if (stop_) return;
+
+		off_t off = fetch_off_;
+		auto gen = gen_;
+		lk.unlock();
+		vector<uchar> data(min<off_t>(block_sz_, size_ - off));
+		fseeko(file_, off, SEEK_SET);
+		data.resize(fread(data.data(), 1, data.size(), file_));
+		lk.lock();
+
+		if (gen != gen_) continue;  // restarted meanwhile
+		if (data.empty()) {
+			fetch_off_ = size_;
+		} else {
+			fetch_off_ += data.size();
+			queued_ += data.size();
+			blocks_.push_back({off, move(data)});
+		}
+		cv_.notify_all();
+	}
+}
+
+void ReadAhead::restartAt(off_t off) {
+	logg(VV, "read-ahead: restarting at ", off, '\n');
+	blocks_.clear();
+	queued_ = 0;
+	fetch_off_ = off;
+	gen_++;
+	cv_.notify_all();
+}
+
+size_t ReadAhead::read(off_t off, uchar* dest, size_t n) {
+	size_t nread = 0;
+	unique_lock<mutex> lk(mtx_);
+	while (nread < n) {
+		off_t cur = off + nread;
+		if (cur >= size_) break;
+
+		while (blocks_.size() && blocks_.front().off + to_int64(blocks_.front().data.size()) <= cur) {
+			queued_ -= blocks_.front().data.size();
+			blocks_.pop_front();
+			cv_.notify_all();
+		}
+
+		if (cur < streamBegin()) {
+			lk.unlock();
+			fseeko(sync_file_, cur, SEEK_SET);
+			return nread + fread(dest + nread, 1, n - nread, sync_file_);
+		}
+
+		if (blocks_.empty()) {
+			if (cur > fetch_off_) restartAt(cur);
+			cv_.wait(lk, [&]{ return blocks_.size() || fetch_off_ >= size_; });
+			continue;
+		}
+
+		auto& b = blocks_.front();
+		size_t k = min<size_t>(n - nread, b.data.size() - (cur - b.off));
+		memcpy(dest + nread, b.data.data() + (cur - b.off), k);
+		nread += k;
+	}
+	return nread;
+}
+
+FileRead::FileRead(const string& filename, bool allow_stream) {
+	open(filename, allow_stream);
 }
 
 FileRead::~FileRead() {
+#ifndef _WIN32
+	if (map_) munmap((void*)map_, map_len_);
+#endif
 	if(file_){
 		fclose(file_);
-		free(buffer_);
+		if (windows_.empty()) free(buffer_);
+		for (auto& w : windows_) free(w.buf);
 	}
+	memGive(mem_taken_);
 }
 
-void FileRead::open(const string& filename) {
+void FileRead::open(const string& filename, bool allow_stream) {
 	filename_ = filename;
-	file_ = my_open(filename.c_str(), "rb");
+	if (allow_stream && filename == "-") {
+		file_ = stdin;
+#ifdef _WIN32
+		_setmode(_fileno(stdin), _O_BINARY);
+#endif
+	}
+	else file_ = my_open(filename.c_str(), "rb");
 
 	if (!file_) throw("Could not open file '" + filename + "': " + strerror(errno));
 
+	if (!isRegularFile(fileno(file_))) {
+		if (!allow_stream) throw("not a regular file: " + filename);
+		logg(I, "reading '", filename, "' as stream\n");
+		stream_ = true;
+		size_ = numeric_limits<off_t>::max() / 4;
+		return;
+	}
+
 	fseeko(file_, 0L, SEEK_END);
 	size_ = ftello(file_);
 	fseeko(file_, 0L, SEEK_SET);
 
-	if (!isRegularFile(fileno(file_))) throw("not a regular file: " + filename);
+	if (!g_read_ahead && g_use_mmap && tryMap()) return;
+
+	size_t n_windows = max(g_file_windows, 1U);
+	size_t min_window = 2 * g_max_buf_sz_needed;
+	mem_taken_ = memTake(buf_size_, min_window, "read buffer of " + filename);
+	n_windows = max<size_t>(1, min(n_windows, mem_taken_ / min_window));
+	buf_size_ = max(mem_taken_ / n_windows, min_window);
+	for (size_t i = 0; i < n_windows; i++)
+		windows_.push_back({(uchar*) malloc(buf_size_), numeric_limits<off_t>::min() / 2, 0});
+	buffer_ = windows_[0].buf;
+	buf_begin_ = windows_[0].begin = 0;
 
-	buffer_ = (uchar*) malloc(buf_size_);
-	fread(buffer_, 1, buf_size_, file_);
+	if (g_read_ahead) read_ahead_.reset(new ReadAhead(filename, file_, size_, g_read_ahead));
+	readAt(0, buffer_, buf_size_);
+}
+
+void FileRead::streamFill(off_t end) {
+	if (stream_eof_ || end <= buf_begin_ + stream_len_) return;
+
+	off_t drop = min({keep_from_ - buf_begin_, buf_off_, stream_len_});
+	if (drop > 0) {
+		memmove(stream_buf_.data(), stream_buf_.data() + drop, stream_len_ - drop);
+		buf_begin_ += drop;
+		buf_off_ -= drop;
+		stream_len_ -= drop;
+	}
+
+	size_t needed = end - buf_begin_;
+	if (needed > stream_buf_.size())
+		stream_buf_.resize(max(needed, 2 * stream_buf_.size()));
+
+	while (to_size_t(stream_len_) < needed) {
+		size_t n = fread(stream_buf_.data() + stream_len_, 1, stream_buf_.size() - stream_len_, file_);
+		if (!n) {
+			stream_eof_ = true;
+			size_ = buf_begin_ + stream_len_;
+			memset(stream_buf_.data() + stream_len_, 0, stream_buf_.size() - stream_len_);
+			logg(V, "end of stream at ", size_, '\n');
+			break;
+		}
+		stream_len_ += n;
+	}
+}
+
+const uchar* FileRead::getStreamPtr(int size_requested) {
+	if (buf_off_ < 0) throw ss("stream: offset ", pos(), " is no longer buffered (", buf_begin_, ")");
+	streamFill(pos() + size_requested);
+	if (to_size_t(buf_off_ + size_requested) > stream_buf_.size())
+		stream_buf_.resize(buf_off_ + size_requested);  // beyond EOF, zero-filled
+	return stream_buf_.data() + buf_off_;
+}
+
+void FileRead::switchWindow(size_t idx) {
+	windows_[cur_win_].begin = buf_begin_;
+	cur_win_ = idx;
+	auto& w = windows_[idx];
+	w.last_use = ++use_cnt_;
+	buffer_ = w.buf;
+	buf_begin_ = w.begin;
+}
+
+size_t FileRead::readAt(off_t off, uchar* dest, size_t n) {
+	if (read_ahead_) return read_ahead_->read(off, dest, n);
+	if (ftello(file_) != off) fseeko(file_, off, SEEK_SET);
+	return fread(dest, 1, n, file_);
+}
+
+bool FileRead::tryMap() {
+#ifdef _WIN32
+	return false;
+#else
+	// reading slightly beyond EOF is common (e.g. loadFragment near the end),
+	// so we reserve a zero-filled tail and map the file over its beginning
+	const size_t kTailPad = 1<<26;  // 64 MiB, only address space
+	if (!size_ || to_uint64(size_) > SIZE_MAX - kTailPad) return false;
+	size_t len = size_ + kTailPad;
+
+	void* p = mmap(nullptr, len, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) return false;
+	if (mmap(p, size_, PROT_READ, MAP_PRIVATE | MAP_FIXED, fileno(file_), 0) == MAP_FAILED) {
+		logg(V, "mmap failed for '", filename_, "': ", strerror(errno), '\n');
+		munmap(p, len);
+		return false;
+	}
+
+	map_ = (const uchar*) p;
+	map_len_ = len;
+	buf_begin_ = buf_off_ = 0;
+	logg(V, "mapped '", filename_, "' (", pretty_bytes(size_), ")\n");
+	return true;
+#endif
+}
+
+const uchar* FileRead::getMappedPtr(int size_requested) {
+	if (buf_off_ >= 0 && to_size_t(buf_off_) + size_requested <= map_len_)
+		return map_ + buf_off_;
+
+	if (buf_off_ < 0) throw ss("negative offset ", buf_off_, " in '", filename_, "'");
+
+	// far beyond EOF, mimic the buffered reader
+	logg(VV, "size_requested beyond mapping: ", size_requested, " at ", buf_off_, '\n');
+	if (!buffer_) {
+		mem_taken_ = memTake(buf_size_, 2 * g_max_buf_sz_needed, "read buffer of " + filename_);
+		buf_size_ = mem_taken_;
+		buffer_ = (uchar*) malloc(buf_size_);
+	}
+	size_requested = min<ssize_t>(size_requested, buf_size_);
+	off_t avail = max<off_t>(0, min<off_t>(size_requested, size_ - buf_off_));
+	memcpy(buffer_, map_ + buf_off_, avail);
+	memset(buffer_ + avail, 0, size_requested - avail);
+	return buffer_;
 }
 
 void FileRead::seek(off_t p) {
-	if (p < buf_begin_ || p >= buf_begin_ + buf_size_){
-		fillBuffer(p);
-	} else
+	if (map_) {
+		buf_off_ = p;
+		return;
+	}
+	if (stream_) {
+		if (p < buf_begin_) throw ss("stream: can't seek back to ", p, " (", buf_begin_, ")");
+		buf_off_ = p - buf_begin_;
+		return;
+	}
+	if (p >= buf_begin_ && p < buf_begin_ + buf_size_) {
 		buf_off_ = p - buf_begin_;
+		return;
+	}
+
+	windows_[cur_win_].begin = buf_begin_;
+	size_t lru = cur_win_;
+	for (size_t i = 0; i < windows_.size(); i++) {
+		auto& w = windows_[i];
+		if (p >= w.begin && p < w.begin + buf_size_) {
+			hits_++;
+			switchWindow(i);
+			buf_off_ = p - buf_begin_;
+			return;
+		}
+		if (w.last_use < windows_[lru].last_use) lru = i;
+	}
+
+	misses_++;
+	switchWindow(lru);
+	fillBuffer(p);
 }
 
 void FileRead::seekSafe(off_t p) {
@@ -75,6 +366,7 @@ off_t FileRead::pos() {
 }
 
 bool FileRead::atEnd() {
+	if (stream_) streamFill(pos() + 1);
 	return pos() >= size_;
 }
 
@@ -85,19 +377,33 @@ size_t FileRead::fillBuffer(off_t location) {
 	buf_begin_ = location;
 	buf_off_ = 0;
 	if (avail < 0 || avail >= buf_size_) {
-		fseeko(file_, location, SEEK_SET);
-		int n = fread(buffer_, 1, buf_size_, file_);
+		int n = readAt(location, buffer_, buf_size_);
 		return n;
 	}else if (avail > 0) {
 		memmove(buffer_, buffer_+buf_loc, buf_size_-buf_loc);
 	}
-	int n = fread(buffer_+avail, 1, buf_size_-avail, file_);
+	int n = readAt(location+avail, buffer_+avail, buf_size_-avail);
 	return n;
 }
 
 size_t FileRead::readBuffer(uchar* dest, size_t size, size_t n) {
 	logg(VV, "requests: ", size*n, " at offset : ", buf_off_, '\n');
 	size_t total = size*n;
+	if (stream_) {
+		getStreamPtr(0);
+		streamFill(pos() + total);
+		size_t nread = min<off_t>(total, max<off_t>(0, stream_len_ - buf_off_));
+		memcpy(dest, stream_buf_.data() + buf_off_, nread);
+		buf_off_ += nread;
+		return nread/size;
+	}
+	if (map_) {
+		size_t avail = buf_off_ < size_ ? size_ - buf_off_ : 0;
+		size_t nread = min(total, avail);
+		memcpy(dest, map_ + buf_off_, nread);
+		buf_off_ += nread;
+		return nread/size;
+	}
 	size_t avail = buf_size_ - buf_off_;
 	size_t nread = 0;
 	if (avail < total) {
@@ -107,9 +413,10 @@ size_t FileRead::readBuffer(uchar* dest, size_t size, size_t n) {
 		total -= avail;
 		buf_off_ = buf_size_;
 		if (total >= to_uint(buf_size_)){
-			size_t x = fread(dest+nread, 1, total, file_);
+			off_t off = buf_begin_ + buf_off_;
+			size_t x = readAt(off, dest+nread, total);
 			nread += x;
-			fillBuffer(ftello(file_));
+			fillBuffer(off + x);
 		} else {
 			size_t x = min(fillBuffer(buf_begin_+buf_off_), total);
 			memcpy(dest+nread, buffer_, x);
@@ -164,6 +471,8 @@ vector<uchar> FileRead::read(size_t n) {
 }
 
 const uchar* FileRead::getPtr(int size_requested) {
+	if (map_) return getMappedPtr(size_requested);
+	if (stream_) return getStreamPtr(size_requested);
 	// check if requested size exceeds buffer
 	if (buf_off_ + size_requested > buf_size_){
 		logg(VV, "size_requested: ", size_requested, '\n');
@@ -206,44 +515,163 @@ bool FileRead::alreadyExists(const string& fn) {
 }
 
 
-FileWrite::FileWrite(const string& filename) {
-	file_ = my_open(filename.c_str(), "wb");
+FileWrite::FileWrite(const string& filename, bool in_place) {
+	if (filename == "-" && !in_place) {
+		file_ = stdout;
+#ifdef _WIN32
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
+	}
+	else file_ = in_place ? my_open(filename.c_str(), "r+b") : my_open(filename.c_str(), "wb");
 	if(!file_)
 		throw "Could not create file '" + filename + "': " + strerror(errno);
+
+	struct stat st;
+	pipe_ = fstat(fileno(file_), &st) == 0 && !S_ISREG(st.st_mode);
 }
 
 FileWrite::~FileWrite() {
-	if(file_) fclose(file_);
+	try {
+		close();
+	}
+	catch (const string& e) {
+		logg(E, e, '\n');
+	}
+}
+
+void FileWrite::close() {
+	if (!file_) return;
+	string err;
+	try {
+		if (direct_buf_) finishDirect();
+	}
+	catch (const string& e) { err = e; }
+	int r = file_ == stdout ? fflush(file_) : fclose(file_);
+	if (r && err.empty()) err = ss("closing the output failed: ", strerror(errno));
+	file_ = nullptr;
+	if (err.size()) throw err;
+}
+
+bool FileWrite::enableDirectIO() {
+#ifdef __linux__
+	fflush(file_);
+	int fd = fileno(file_);
+	off_t off = ftello(file_);
+	int flags = fcntl(fd, F_GETFL);
+	if (pipe_ || off % kDirectAlign || flags < 0 || fcntl(fd, F_SETFL, flags | O_DIRECT) < 0) {
+		logg(V, "O_DIRECT not available: ", strerror(errno), '\n');
+		return false;
+	}
+	direct_sz_ = memTake(kDirectBufSize, kDirectAlign * 16, "direct-I/O buffer");
+	direct_sz_ -= direct_sz_ % kDirectAlign;
+	if (posix_memalign((void**)&direct_buf_, kDirectAlign, direct_sz_)) {
+		fcntl(fd, F_SETFL, flags);
+		memGive(direct_sz_);
+		direct_buf_ = nullptr;
+		return false;
+	}
+	direct_written_ = off;
+	kernel_copy_ok_ = false;
+	return true;
+#else
+	return false;
+#endif
+}
+
+void FileWrite::preallocate(off_t size) {
+#ifdef __linux__
+	// not posix_fallocate, glibc emulates it by writing every block (e.g. on NFS)
+	if (fallocate(fileno(file_), 0, 0, size) == 0) preallocated_ = true;
+	else if (errno == EOPNOTSUPP) logg(V, "no preallocation, not supported by the filesystem\n");
+	else logg(V, "fallocate failed: ", strerror(errno), '\n');
+#endif
+}
+
+void FileWrite::flushDirect() {
+#ifdef __linux__
+	size_t n = direct_len_ - direct_len_ % kDirectAlign;
+	for (size_t done = 0; done < n;) {
+		ssize_t x = ::write(fileno(file_), direct_buf_ + done, n - done);
+		if (x <= 0) throw ss("direct write failed: ", strerror(errno));
+		done += x;
+	}
+	memmove(direct_buf_, direct_buf_ + n, direct_len_ - n);
+	direct_len_ -= n;
+	direct_written_ += n;
+#endif
+}
+
+void FileWrite::finishDirect() {
+#ifdef __linux__
+	string err;
+	try {
+		flushDirect();
+	}
+	catch (const string& e) { err = e; }
+	int fd = fileno(file_);
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);  // unaligned tail
+	if (err.empty() && direct_len_ && ::write(fd, direct_buf_, direct_len_) != to_int64(direct_len_))
+		err = ss("writing the tail failed: ", strerror(errno));
+	direct_written_ += direct_len_;
+	if (err.empty() && preallocated_ && ftruncate(fd, direct_written_))
+		err = ss("ftruncate failed: ", strerror(errno));
+	lseek(fd, direct_written_, SEEK_SET);
+	free(direct_buf_);
+	memGive(direct_sz_);
+	direct_buf_ = nullptr;
+	if (err.size()) throw err;
+#endif
+}
+
+size_t FileWrite::put(const void* source, size_t n) {
+	written_ += n;
+	if (!direct_buf_) return fwrite(source, 1, n, file_);
+	auto src = (const uchar*) source;
+	for (size_t done = 0; done < n;) {
+		size_t k = min(n - done, direct_sz_ - direct_len_);
+		memcpy(direct_buf_ + direct_len_, src + done, k);
+		direct_len_ += k;
+		done += k;
+		if (direct_len_ == direct_sz_) flushDirect();
+	}
+	return n;
 }
 
 off_t FileWrite::pos() {
+	if (direct_buf_) return direct_written_ + direct_len_;
+	if (pipe_) return written_;
 	return ftello(file_);
 }
 
+void FileWrite::seek(off_t p) {
+	if (pipe_) throw ss("can't seek in output stream (to ", p, ")");
+	fseeko(file_, p, SEEK_SET);
+}
+
 int FileWrite::writeInt(int n) {
 	n = swap32(n);
-	fwrite(&n, sizeof(int), 1, file_);
+	put(&n, sizeof(int));
 	return 4;
 }
 
 int FileWrite::writeInt64(int64_t n) {
 	n = swap64(n);
-	fwrite(&n, sizeof(n), 1, file_);
+	put(&n, sizeof(n));
 	return 8;
 }
 
 int FileWrite::writeChar(const char *source, size_t n) {
-	fwrite(source, 1, n, file_);
+	put(source, n);
 	return n;
 }
 
 int FileWrite::writeChar(const uchar *source, size_t n) {
-	fwrite(source, 1, n, file_);
+	put(source, n);
 	return n;
 }
 
 int FileWrite::write(vector<uchar> &v) {
-	fwrite(&*v.begin(), 1, v.size(), file_);
+	put(&*v.begin(), v.size());
 	return v.size();
 }
 
@@ -255,7 +683,8 @@ void FileWrite::copyRange(FileRead& fin, size_t a, size_t b) {
 		cout << n << string(15, ' ') << '\r';
 		auto to_read = min(buff_sz, n);
 		auto p = fin.getPtr2(to_read);
-		assert(to_read == fwrite(p, 1, to_read, file_));
+		auto written = put(p, to_read);
+		assert(to_read == written);
 		n -= to_read;
 	}
 }
@@ -264,11 +693,66 @@ void FileWrite::copyN(FileRead& fin, size_t start_off, size_t n) {
 	copyRange(fin, start_off, start_off + n);
 }
 
+size_t FileWrite::copyFrom(FileRead& fin, off_t off, size_t n) {
+#ifdef __linux__
+	if (!kernel_copy_ok_ || fin.isStream()) return 0;
+	fflush(file_);
+	off_t out_off = ftello(file_);
+	int in_fd = fin.fd(), out_fd = fileno(file_);
+	size_t done = 0;
+
+#ifdef __GLIBC__
+#if __GLIBC_PREREQ(2, 27)
+	while (!pipe_ && done < n) {
+		chkCancelled();
+		ssize_t x = copy_file_range(in_fd, &off, out_fd, &out_off, n - done, 0);
+		if (x <= 0) break;
+		done += x;
+	}
+#endif
+#endif
+	if (!done && (pipe_ || lseek(out_fd, out_off, SEEK_SET) == out_off)) {
+		while (done < n) {
+			chkCancelled();
+			ssize_t x = sendfile(out_fd, in_fd, &off, n - done);
+			if (x <= 0) break;
+			done += x;
+			out_off += x;
+		}
+	}
+
+	if (!done) {
+		logg(V, "in-kernel copy not available: ", strerror(errno), '\n');
+		kernel_copy_ok_ = false;
+	}
+	if (pipe_) written_ += done;
+	else fseeko(file_, out_off, SEEK_SET);
+	return done;
+#else
+	return 0;
+#endif
+}
+
 bool isdir(const string& path) {
 	struct stat st;
 	return (stat(path.c_str(), &st) == 0) && (st.st_mode & S_IFDIR);
 }
 
+// regular files in dir, sorted
+vector<string> listDir(const string& dir) {
+	vector<string> r;
+	DIR* d = opendir(dir.c_str());
+	if (!d) return r;
+	while (auto e = readdir(d)) {
+		string fn = dir + "/" + e->d_name;
+		struct stat st;
+		if (stat(fn.c_str(), &st) == 0 && S_ISREG(st.st_mode)) r.push_back(fn);
+	}
+	closedir(d);
+	sort(r.begin(), r.end());
+	return r;
+}
+
 string myBasename(string path) {
 	// basename may modifies its argument
 	return basename(&path[0]);
@@ -28,6 +28,7 @@ extern "C" {
 #include <stdio.h>
 #include <vector>
 #include <string>
+#include <memory>
 
 #ifdef __APPLE__
 #include <sys/types.h> /* ssize_t */
@@ -35,13 +36,15 @@ extern "C" {
 
 #include "common.h"
 
+class ReadAhead;
+
 class FileRead {
 public:
-	FileRead(const std::string& filename);
+	FileRead(const std::string& filename, bool allow_stream=false);
 	explicit FileRead(const FileRead&) = delete;
 
 	~FileRead();
-	void open(const std::string& filename);
+	void open(const std::string& filename, bool allow_stream=false);
 
 	void seek(off_t p);
 	void seekSafe(off_t p);
@@ -61,30 +64,69 @@ public:
 	const uchar* getPtr2(int size_requested);  // changes state (buf_off_)
 	const uchar* getPtrAt(off_t pos, int size_requested);
 	const uchar* getFragment(off_t pos, int size);
-	ssize_t buf_size_ = 15*(1<<20); // 15 MB
+	ssize_t buf_size_ = 15*(1<<20); // 15 MB, split between windows
 
 	std::string filename_;
 
 	static bool alreadyExists(const std::string& fn);
+	bool isMapped() const { return map_ != nullptr; }
+	int fd() const { return fileno(file_); }
+	bool isStream() const { return stream_; }
+	void keepFrom(off_t p) { keep_from_ = p; }  // stream: older data may be dropped
+	void prefetch(off_t end) { if (stream_) streamFill(end); }
+	uint64_t cacheHits() const { return hits_; }
+	uint64_t cacheMisses() const { return misses_; }
 
 protected:
 	size_t fillBuffer(off_t location);
-	uchar* buffer_;
+	uchar* buffer_ = nullptr;
 	off_t size_;
 	FILE* file_ = nullptr;
 	off_t buf_begin_ = 0;
 	off_t buf_off_ = 0;
 
+	// if mapped, buf_begin_ stays 0 and buf_off_ is the absolute position
+	const uchar* map_ = nullptr;
+	size_t map_len_ = 0;  // including zero-filled tail
+	bool tryMap();
+	const uchar* getMappedPtr(int size_requested);
+
+	std::unique_ptr<ReadAhead> read_ahead_;
+	size_t readAt(off_t off, uchar* dest, size_t n);
+
+	// independently positioned buffers, the active one is buffer_/buf_begin_
+	struct Window {
+		uchar* buf;
+		off_t begin;
+		uint64_t last_use;
+	};
+	std::vector<Window> windows_;
+	size_t cur_win_ = 0;
+	uint64_t use_cnt_ = 0, hits_ = 0, misses_ = 0;
+	void switchWindow(size_t idx);
+	size_t mem_taken_ = 0;
+
+	// non-seekable input, forward-only window [buf_begin_, buf_begin_ + stream_len_)
+	// size_ is a sentinel until EOF was reached
+	bool stream_ = false, stream_eof_ = false;
+	std::vector<uchar> stream_buf_;
+	off_t stream_len_ = 0;
+	off_t keep_from_ = 0;
+	void streamFill(off_t end);
+	const uchar* getStreamPtr(int size_requested);
+
 private:
 	static bool isRegularFile(int fd);
 };
 
 class FileWrite {
 public:
-	FileWrite(const std::string& filename);
+	FileWrite(const std::string& filename, bool in_place=false);
 	~FileWrite();
+	void close();  // throws on write errors, the destructor only logs them
 
 	off_t pos();
+	void seek(off_t p);
 
 	int writeInt(int n);
 	int writeInt64(int64_t n);
@@ -94,12 +136,32 @@ public:
 
 	void copyRange(FileRead& fin, size_t a, size_t b);
 	void copyN(FileRead& fin, size_t start_off, size_t n);
+	size_t copyFrom(FileRead& fin, off_t off, size_t n);  // in-kernel, might copy less
+
+	bool isPipe() const { return pipe_; }
+	bool enableDirectIO();  // bypass page cache, no seek() afterwards
+	void preallocate(off_t size);
 
 protected:
 	FILE *file_;
+	bool kernel_copy_ok_ = true;
+	bool pipe_ = false;  // not seekable, pos() counts bytes
+	off_t written_ = 0;
+
+	size_t put(const void* source, size_t n);
+
+	static constexpr size_t kDirectAlign = 4096;
+	static constexpr size_t kDirectBufSize = 8<<20;
+	uchar* direct_buf_ = nullptr;
+	size_t direct_sz_ = 0, direct_len_ = 0;
+	off_t direct_written_ = 0;
+	bool preallocated_ = false;
+	void flushDirect();
+	void finishDirect();
 };
 
 bool isdir(const std::string& path);
+std::vector<std::string> listDir(const std::string& dir);
 std::string myBasename(std::string path);
 
 #endif // FILE_H
@@ -330,7 +330,8 @@ uiControl* Gui::analyzeTab() {
 		defineFileForAnalyze();  // for findAtomNames, file_ok can be truncated as well
 		setDisabled(true);
 		Analyze::onProgress(0);
-		thread_ = new thread([](const string& file){
+		thread_ = new thread([opts = Options()](const string& file){
+			opts.apply();  // options are per thread
 			try {
 				Atom::findAtomNames(file);
 				Analyze::onProgress(100);
@@ -407,7 +408,8 @@ void Gui::startRepair(uiButton* b, void* data) {
 
 	setDisabled(true);
 	Repair::onProgress(0);
-	thread_ = new thread([](const string& file_ok, const string& file_bad){
+	thread_ = new thread([opts = Options()](const string& file_ok, const string& file_bad){
+		opts.apply();  // options are per thread
 		string output_suffix = g_ignore_unknown ? ss("-s", Mp4::step_) : "";
 
 		try {
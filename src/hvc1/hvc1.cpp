@@ -58,7 +58,7 @@ LenResult getLengths(Codec* self, const uchar* start, uint maxlength) {
 				break;
 			return r;
 		case NAL_FILLER_DATA:
-			if (g_log_mode >= V) {
+			if (logEnabled(V)) {
 				logg(V, "found filler data: ");
 				printBuffer(pos, 30);
 			}
@@ -100,7 +100,21 @@ int getSizeHvc1(Codec* self, const uchar* start, uint maxlength) {
 	if (r.alternative_lengths.size()) {
 		auto& lens = r.alternative_lengths;
 		lens.push_back(r.length);
+		if (g_beam_width) return g_mp4->beamSearchSize(self, lens);
 		return g_mp4->findSizeWithContinuation(self->cur_off_, lens);
 	}
 	return r.length;
 }
+
+vector<int> getLengthsHvc1(Codec* self, off_t offset, uint maxlength) {
+	auto orig_off = self->cur_off_;
+	auto orig_keyframe = self->was_keyframe_;
+	self->cur_off_ = offset;
+	auto r = getLengths(self, self->loadAfter(0), maxlength);
+	self->cur_off_ = orig_off;
+	self->was_keyframe_ = orig_keyframe;
+
+	auto& lens = r.alternative_lengths;
+	if (r.length) lens.push_back(r.length);
+	return lens;
+}
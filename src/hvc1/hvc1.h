@@ -1,9 +1,12 @@
 #ifndef HVC1_H
 #define HVC1_H
 
+#include <vector>
+
 #include "../common.h"
 
 class Codec;
 int getSizeHvc1(Codec* self, const uchar* start, uint maxlength);
+std::vector<int> getLengthsHvc1(Codec* self, off_t offset, uint maxlength);  // all plausible frame ends
 
 #endif // HVC1_H
@@ -0,0 +1,247 @@
+#include "mp4.h"
+#include "atom.h"
+#include "file.h"
+#include "common.h"
+#include "checkpoint.h"
+
+using namespace std;
+
+/* '-idx' saves the scan results to <output>.idx, '-mux <index>' writes a video from them
+   without scanning again, e.g. to try '-sv', '-noctts', '-k' or '-drop <codec>'.
+   The file is meant to be read by other tools too. All fields are big-endian, offsets
+   are relative to the mdat content of the corrupt file, before exclusion:
+
+     char[12] "untrunc-idx\0"   u32 version
+     u32 n, char[n] key          the corrupt file and its tracks, checked by '-mux'
+     u64 mdat content start      absolute
+     u8  kept                    1 if made with '-k'
+     i64 premature end           -1 if the scan reached the end
+     u32 n_tracks                then per track: char[4] codec, u32 timescale
+     u64 n_excluded              then per sequence: u64 offset, u64 length
+     u64 n_samples               then per sample, in file order:
+         u64 offset, u32 size, u16 track, u8 flags, u32 duration (in the track's timescale)
+
+   flags: 1 = keyframe, 2 = starts a chunk. A track without keyframes has no stss,
+   all its samples are keyframes then.
+*/
+
+namespace {
+constexpr uint32_t kIndexVersion = 2;
+const string kIndexMagic("untrunc-idx\0", 12);
+enum { kKeyframe = 1, kChunkStart = 2 };
+constexpr size_t kSampleSize = 8 + 4 + 2 + 1 + 4;
+
+struct BeWriter {
+	vector<uchar> buf_;
+	void put(uint64_t x, int n) {
+		for (int i = n-1; i >= 0; i--) buf_.push_back(x >> (8*i));
+	}
+	void put(const string& s) { buf_.insert(buf_.end(), s.begin(), s.end()); }
+};
+
+struct BeReader {
+	const uchar *p_, *end_;
+	uint64_t get(int n) {
+		need(n);
+		uint64_t x = 0;
+		for (int i=0; i < n; i++) x = x << 8 | *p_++;
+		return x;
+	}
+	string getString(size_t n) {
+		need(n);
+		string s((const char*)p_, n);
+		p_ += n;
+		return s;
+	}
+	size_t left() const { return end_ - p_; }
+	bool atEnd() const { return p_ == end_; }
+	void need(size_t n) { if (left() < n) throw string("data is truncated"); }
+};
+
+struct Sample {
+	off_t off;
+	uint32_t size, duration;
+	uint16_t track;
+	uint8_t flags;
+};
+}
+
+vector<uchar> Mp4::makeIndex() {
+	auto mdat = current_mdat_;
+	vector<Sample> samples;
+	samples.reserve(pkt_idx_);
+	for (uint ti=0; ti < tracks_.size(); ti++) {
+		auto& t = tracks_[ti];
+		if (t.is_dummy_) continue;
+		size_t i = 0, k = 0;
+		for (auto& c : t.chunks_) {
+			off_t off = c.off_;
+			for (int j=0; j < c.n_samples_; j++, i++) {
+				uint8_t flags = j ? 0 : kChunkStart;
+				while (k < t.keyframes_.size() && to_size_t(t.keyframes_[k]) < i) k++;
+				if (k < t.keyframes_.size() && to_size_t(t.keyframes_[k]) == i) flags |= kKeyframe;
+				int dur = t.constant_duration_ != -1 ? t.constant_duration_ : i < t.times_.size() ? t.times_[i] : 0;
+				uint32_t sz = t.getSize(i);
+				samples.push_back({off, sz, (uint32_t)dur, (uint16_t)ti, flags});
+				off += sz;
+			}
+		}
+	}
+	stable_sort(samples.begin(), samples.end(), [](const Sample& a, const Sample& b) { return a.off < b.off; });
+
+	BeWriter w;
+	w.put(kIndexMagic);
+	w.put(kIndexVersion, 4);
+	auto key = indexKey();
+	w.put(key.size(), 4);
+	w.put(key);
+	w.put(mdat->contentStart(), 8);
+	w.put(g_dont_exclude, 1);
+	w.put(premature_end_ ? mdat->file_end_ - mdat->contentStart() : -1, 8);
+
+	w.put(tracks_.size() - tracks_.back().is_dummy_, 4);
+	for (auto& t : tracks_) {
+		if (t.is_dummy_) continue;
+		w.put((t.codec_.name_ + "    ").substr(0, 4));
+		w.put(t.timescale_, 4);
+	}
+	w.put(mdat->sequences_to_exclude_.size(), 8);
+	for (auto [off, len] : mdat->sequences_to_exclude_) {
+		w.put(off, 8);
+		w.put(len, 8);
+	}
+	w.put(samples.size(), 8);
+	for (auto& s : samples) {
+		w.put(s.off, 8);
+		w.put(s.size, 4);
+		w.put(s.track, 2);
+		w.put(s.flags, 1);
+		w.put(s.duration, 4);
+	}
+
+	return w.buf_;
+}
+
+void Mp4::writeIndex(const string& path, const vector<uchar>& data) {
+	if (!writeFileAtomically(path, data)) logg(ET, "could not write index '", path, "'\n");
+	logg(I, "wrote sample index to '", path, "' (", pretty_bytes(data.size()), ")\n");
+}
+
+bool Mp4::loadIndex(const string& path) {
+	vector<uchar> data;
+	if (!readWholeFile(path, data)) logg(ET, "could not read index '", path, "'\n");
+
+	bool kept = false;
+	auto mdat = current_mdat_;
+	try {
+		BeReader r{data.data(), data.data() + data.size()};
+		if (r.getString(kIndexMagic.size()) != kIndexMagic || r.get(4) != kIndexVersion)
+			throw string("unknown format, save it again");
+		if (r.getString(r.get(4)) != indexKey() || to_int64(r.get(8)) != mdat->contentStart())
+			throw string("it was made for a different file");
+
+		kept = r.get(1);
+		auto premature_at = (int64_t)r.get(8);
+		r.get(4);  // track list, for other tools
+		for (auto& t : tracks_) if (!t.is_dummy_) r.get(8);
+
+		auto& excl = mdat->sequences_to_exclude_;
+		excl.resize(r.get(8));
+		for (auto& [off, len] : excl) {
+			off = r.get(8);
+			len = r.get(8);
+			mdat->total_excluded_yet_ += len;
+		}
+		// chunks get the length excluded before them, as during the scan
+		auto excludedBefore = [&, it = excl.begin(), sum = (int64_t)0](off_t off) mutable {
+			for (; it != excl.end() && it->first < off; it++) sum += it->second;
+			return sum;
+		};
+
+		vector<vector<int>> times(tracks_.size());
+		auto n = r.get(8);
+		if (n > r.left() / kSampleSize) throw string("data is truncated");
+		for (uint64_t i=0; i < n; i++) {
+			off_t off = r.get(8);
+			int size = r.get(4);
+			auto ti = r.get(2);
+			auto flags = r.get(1);
+			int dur = r.get(4);
+			if (ti >= tracks_.size() || tracks_[ti].is_dummy_) throw string("corrupt data");
+
+			auto& t = tracks_[ti];
+			if (flags & kChunkStart || t.chunks_.empty()) {
+				t.chunks_.emplace_back(off, 0, 0);
+				t.chunks_.back().already_excluded_ = excludedBefore(off);
+			}
+			t.chunks_.back().n_samples_++;
+			if (flags & kKeyframe) t.keyframes_.push_back(t.num_samples_);
+			if (!t.constant_size_) t.sizes_.push_back(size);
+			times[ti].push_back(dur);
+			t.num_samples_++;
+			pkt_idx_++;
+		}
+		if (!r.atEnd()) throw string("trailing data");
+
+		for (uint i=0; i < tracks_.size(); i++) {
+			auto& ts = times[i];
+			if (tracks_[i].constant_duration_ == -1 && count(ts.begin(), ts.end(), 0) != to_int64(ts.size()))
+				tracks_[i].times_ = move(ts);
+		}
+
+		if (premature_at >= 0) {
+			premature_percentage_ = (double)100 * premature_at / mdat->contentSize();
+			premature_end_ = true;
+			mdat->file_end_ = toAbsOff(premature_at);
+			mdat->length_ = premature_at + 8;
+			logg(W, "the scan ended prematurely at ", offToStr(premature_at), "\n");
+		}
+	}
+	catch (const string& e) {
+		logg(ET, "can't use index '", path, "': ", e, "\n");
+	}
+	logg(I, "loaded ", pkt_idx_, " samples from '", path, "'\n");
+	return kept;
+}
+
+void Mp4::mux(const string& filename, const string& index_fn, const vector<string>& drop) {
+	prepareRepair();
+
+	auto& file_read = openFile(filename);
+	findMdat(file_read);
+	if (file_read.length() > (1LL<<32)) {
+		broken_is_64_ = true;
+		logg(I, "using 64-bit offsets for the broken file\n");
+	}
+
+	duration_ = 0;
+	for (auto& t : tracks_) t.clear();
+	bool kept = loadIndex(index_fn);
+
+	if (kept && !g_dont_exclude) {
+		logg(W, "the index was made with '-k', unknown sequences are kept\n");
+		g_dont_exclude = true;
+	}
+	else if (!kept && g_dont_exclude) {
+		auto mdat = current_mdat_;
+		mdat->sequences_to_exclude_.clear();
+		mdat->total_excluded_yet_ = 0;
+		for (auto& t : tracks_)
+			for (auto& c : t.chunks_) c.already_excluded_ = 0;
+	}
+
+	auto moov = root_atom_->atomByName("moov");
+	for (auto& cn : drop) {
+		int idx = getTrackIdx2(cn);
+		if (idx < 0) logg(ET, "no '", cn, "' track to drop\n");
+		auto& t = tracks_[idx];
+		logg(I, "dropping ", t.num_samples_, " '", cn, "' samples\n");
+		pkt_idx_ -= t.num_samples_;
+		moov->prune(t.trak_);  // the track is gone, not just empty
+		tracks_.erase(tracks_.begin() + idx);
+		afterTrackRealloc();
+	}
+
+	for (auto& t : tracks_) t.fixTimes();
+	saveVideo(getPathRepaired(filename_ok_, filename));
+}
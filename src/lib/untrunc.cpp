@@ -0,0 +1,252 @@
+#include <mutex>
+#include <set>
+#include <map>
+#include <atomic>
+#include <memory>
+
+#include "untrunc.h"
+#include "../mp4.h"
+#include "../common.h"
+
+using namespace std;
+
+/* The C interface. A call applies the options of its context to the calling thread
+   (they are per thread, see Options) and restores the previous ones afterwards.
+   logg(ET, ...) throws there, errors become status codes.
+*/
+
+struct untrunc_ctx {
+	mutex mutex_;
+	Options opts_;
+	untrunc_log_fn log_fn_ = nullptr;
+	void* log_user_ = nullptr;
+	untrunc_progress_fn progress_fn_ = nullptr;
+	void* progress_user_ = nullptr;
+	shared_ptr<Mp4> ref_;  // analyzed, repairs use clones of it
+	set<atomic<bool>*> running_;  // cancel flags
+};
+
+namespace {
+thread_local string last_error;
+
+int invalidArg() {
+	last_error = "null argument";
+	return UNTRUNC_EINVAL;
+}
+
+// what g_cb_data points to during a call
+struct Callbacks {
+	untrunc_log_fn log_fn;
+	void* log_user;
+	untrunc_progress_fn progress_fn;
+	void* progress_user;
+};
+
+void onLog(LogMode m, const string& msg) {
+	auto cb = (Callbacks*)g_cb_data;
+	cb->log_fn(cb->log_user, m == ET ? E : m, msg.c_str());
+}
+
+void onProgress(int percent) {
+	auto cb = (Callbacks*)g_cb_data;
+	cb->progress_fn(cb->progress_user, percent);
+}
+
+template<class F>
+int call(untrunc_ctx* ctx, F fn, const atomic<bool>* cancel=nullptr) {
+	Options prev, opts;
+	Callbacks cb;
+	{
+		lock_guard<mutex> lk(ctx->mutex_);
+		opts = ctx->opts_;
+		cb = {ctx->log_fn_, ctx->log_user_, ctx->progress_fn_, ctx->progress_user_};
+	}
+	opts.g_onLog_ = cb.log_fn ? onLog : nullptr;
+	opts.g_onProgress_ = cb.progress_fn ? onProgress : nullptr;
+	opts.g_cb_data_ = &cb;
+	opts.g_cancel_ = cancel;
+	auto prev_mp4 = g_mp4;
+	opts.apply();
+
+	int r = UNTRUNC_OK;
+	try {
+		fn();
+	}
+	catch (const CancelledError& e) { last_error = e.what(); r = UNTRUNC_CANCELLED; }
+	catch (const exception& e) { last_error = e.what(); r = UNTRUNC_ERROR; }
+	catch (const string& e) { last_error = e; r = UNTRUNC_ERROR; }
+	catch (const char* e) { last_error = e; r = UNTRUNC_ERROR; }
+	trim_right(last_error);
+
+	prev.apply();
+	g_mp4 = prev_mp4;
+	return r;
+}
+
+// changes o via the globals, so the parsing of the command line can be used
+template<class F>
+void withOptions(Options& o, F fn) {
+	Options prev;
+	o.apply();
+	try {
+		fn();
+	}
+	catch (...) {
+		prev.apply();
+		throw;
+	}
+	o = Options();
+	prev.apply();
+}
+
+const map<string, bool Options::*> kSwitches = {
+	{"s", &Options::g_ignore_unknown_},
+	{"k", &Options::g_dont_exclude_},
+	{"sv", &Options::g_stretch_video_},
+	{"dyn", &Options::g_use_chunk_stats_},
+	{"noctts", &Options::g_no_ctts_},
+	{"skip", &Options::g_skip_existing_},
+	{"sm", &Options::g_search_mdat_},
+	{"dcc", &Options::g_ignore_out_of_bound_chunks_},
+	{"ip", &Options::g_in_place_},
+	{"direct", &Options::g_direct_io_},
+	{"idx", &Options::g_write_index_},
+	{"rsv-ben", &Options::g_rsv_ben_mode_},
+};
+
+const map<string, LogMode> kLogLevels = {
+	{"error", E}, {"warning", W}, {"info", I}, {"verbose", V},
+};
+}
+
+untrunc_ctx* untrunc_new(void) {
+	auto ctx = new untrunc_ctx;
+	auto& o = ctx->opts_;
+	o.g_log_mode_ = W;
+	o.g_interactive_ = false;
+	o.g_throw_fatal_ = true;
+	o.g_dont_omit_ = true;  // the noise buffer swaps the rdbuf of std::cout, which belongs to the host
+	return ctx;
+}
+
+void untrunc_free(untrunc_ctx* ctx) {
+	delete ctx;
+}
+
+int untrunc_set_option(untrunc_ctx* ctx, const char* name, const char* value) {
+	last_error.clear();  // a success must not report an older failure
+	if (!ctx || !name) return invalidArg();
+	string n = name, v = value ? value : "";
+	lock_guard<mutex> lk(ctx->mutex_);
+	auto& o = ctx->opts_;
+
+	auto sw = kSwitches.find(n);
+	if (sw != kSwitches.end()) {
+		o.*(sw->second) = v != "0";
+		return UNTRUNC_OK;
+	}
+	if (n == "nomm") {o.g_use_mmap_ = v == "0"; return UNTRUNC_OK;}
+	if (n == "nokc") {o.g_kernel_copy_ = v == "0"; return UNTRUNC_OK;}
+
+	try {
+		if (v.empty()) throw invalid_argument("missing value");
+		if (n == "mp") withOptions(o, [&]() { parseMaxPartsize(v); });
+		else if (n == "mem") withOptions(o, [&]() { g_mem_budget = parseByteStr(v); });
+		else if (n == "ra") withOptions(o, [&]() { g_read_ahead = parseByteStr(v); g_use_mmap = false; });
+		else if (n == "j") o.g_threads_ = stoi(v);
+		else if (n == "beam") o.g_beam_width_ = stoi(v);
+		else if (n == "dst") o.g_dst_path_ = v;
+		else if (n == "range") {
+			auto pos = v.find(':');
+			if (pos == string::npos) throw invalid_argument("use python slice notation");
+			auto a = v.substr(0, pos), b = v.substr(pos+1);
+			o.g_range_start_ = a.size() ? stoll(a) : 0;
+			o.g_range_end_ = b.size() ? stoll(b) : numeric_limits<int64_t>::max();
+		}
+		else if (n == "log") {
+			auto it = kLogLevels.find(v);
+			if (it == kLogLevels.end()) throw invalid_argument("unknown log level");
+			o.g_log_mode_ = it->second;
+		}
+		else {
+			last_error = "unknown option '" + n + "'";
+			return UNTRUNC_EINVAL;
+		}
+	}
+	catch (const exception& e) {
+		last_error = ss("bad value for '", n, "': ", e.what());
+		trim_right(last_error);
+		return UNTRUNC_EINVAL;
+	}
+	return UNTRUNC_OK;
+}
+
+void untrunc_set_log_callback(untrunc_ctx* ctx, untrunc_log_fn fn, void* user) {
+	if (!ctx) return;
+	lock_guard<mutex> lk(ctx->mutex_);
+	ctx->log_fn_ = fn;
+	ctx->log_user_ = user;
+}
+
+void untrunc_set_progress_callback(untrunc_ctx* ctx, untrunc_progress_fn fn, void* user) {
+	if (!ctx) return;
+	lock_guard<mutex> lk(ctx->mutex_);
+	ctx->progress_fn_ = fn;
+	ctx->progress_user_ = user;
+}
+
+int untrunc_open_reference(untrunc_ctx* ctx, const char* ok_path) {
+	last_error.clear();
+	if (!ctx || !ok_path) return invalidArg();
+	shared_ptr<Mp4> ref(new Mp4);
+	int r = call(ctx, [&]() {
+		g_mp4 = ref.get();
+		ref->parseOk(ok_path);
+		ref->prepareRepair();
+	});
+	if (r != UNTRUNC_OK) return r;
+
+	lock_guard<mutex> lk(ctx->mutex_);
+	ctx->ref_ = ref;  // running repairs keep the previous one
+	return UNTRUNC_OK;
+}
+
+int untrunc_repair(untrunc_ctx* ctx, const char* corrupt_path, const char* output) {
+	last_error.clear();
+	if (!ctx || !corrupt_path) return invalidArg();
+	shared_ptr<Mp4> ref;
+	atomic<bool> cancelled(false);
+	{
+		lock_guard<mutex> lk(ctx->mutex_);
+		ref = ctx->ref_;
+		if (ref) ctx->running_.insert(&cancelled);
+	}
+	if (!ref) {
+		last_error = "no reference file opened";
+		return UNTRUNC_ENOREF;
+	}
+
+	int r = call(ctx, [&]() {
+		if (output) g_dst_path = output;
+		g_mp4 = ref.get();
+		ref->repairCopy(corrupt_path);
+	}, &cancelled);
+
+	lock_guard<mutex> lk(ctx->mutex_);
+	ctx->running_.erase(&cancelled);
+	return r;
+}
+
+void untrunc_cancel(untrunc_ctx* ctx) {
+	if (!ctx) return;
+	lock_guard<mutex> lk(ctx->mutex_);
+	for (auto c : ctx->running_) *c = true;
+}
+
+const char* untrunc_last_error(void) {
+	return last_error.c_str();
+}
+
+const char* untrunc_version(void) {
+	return g_version_str.c_str();
+}
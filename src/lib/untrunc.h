@@ -0,0 +1,78 @@
+/*
+	Untrunc - untrunc.h
+
+	C interface of libuntrunc. A context holds the options and the analyzed
+	healthy file. Repairs with one context may run on several threads at once,
+	contexts are independent of each other.
+
+	Untrunc is GPL software; you can freely distribute,
+	redistribute, modify & use under the terms of the GNU General
+	Public License; either version 2 or its successor.
+*/
+
+#ifndef UNTRUNC_H
+#define UNTRUNC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct untrunc_ctx untrunc_ctx;
+
+enum untrunc_status {
+	UNTRUNC_OK = 0,
+	UNTRUNC_ERROR = -1,        /* see untrunc_last_error() */
+	UNTRUNC_EINVAL = -2,       /* unknown option or bad value */
+	UNTRUNC_ENOREF = -3,       /* untrunc_open_reference() was not called successfully */
+	UNTRUNC_CANCELLED = -4,
+};
+
+/* same values as the log levels of the command line tool */
+enum untrunc_log_level {
+	UNTRUNC_LOG_ERROR = 1,
+	UNTRUNC_LOG_WARNING = 2,
+	UNTRUNC_LOG_INFO = 3,
+	UNTRUNC_LOG_HIDDEN_WARNING = 4,
+	UNTRUNC_LOG_VERBOSE = 5,
+	UNTRUNC_LOG_DEBUG = 6,
+};
+
+typedef void (*untrunc_log_fn)(void* user, int level, const char* msg);
+typedef void (*untrunc_progress_fn)(void* user, int percent);
+
+untrunc_ctx* untrunc_new(void);
+void untrunc_free(untrunc_ctx* ctx);
+
+/* Options are named like the command line flags, without '-'. Switches take "1" or "0".
+   Supported: s, k, sv, dyn, noctts, skip, sm, dcc, ip, nomm, nokc, direct, idx, rsv-ben,
+   mp <bytes>, mem <bytes>, ra <bytes>, j <n>, beam <k>, range <A:B>, dst <dir|file>,
+   log <error|warning|info|verbose>. The default log level is 'warning'. */
+int untrunc_set_option(untrunc_ctx* ctx, const char* name, const char* value);
+
+/* Without a log callback messages go to stdout. Progress is reported at log level 'info'.
+   Callbacks are called on the thread of the repair, or on its helper threads. */
+void untrunc_set_log_callback(untrunc_ctx* ctx, untrunc_log_fn fn, void* user);
+void untrunc_set_progress_callback(untrunc_ctx* ctx, untrunc_progress_fn fn, void* user);
+
+/* Parses and analyzes the healthy file (or a profile saved with '-save-profile') once. */
+int untrunc_open_reference(untrunc_ctx* ctx, const char* ok_path);
+
+/* output may be NULL, then it is named like the command line tool does (see option 'dst').
+   Options set later on don't affect the analysis done by untrunc_open_reference(). */
+int untrunc_repair(untrunc_ctx* ctx, const char* corrupt_path, const char* output);
+
+/* Stops all running repairs of ctx soon, they return UNTRUNC_CANCELLED.
+   The output file might be left incomplete. New repairs are not affected. */
+void untrunc_cancel(untrunc_ctx* ctx);
+
+/* Message of the last failed call on this thread, valid until the next call.
+   Empty if that call succeeded. */
+const char* untrunc_last_error(void);
+
+const char* untrunc_version(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // UNTRUNC_H
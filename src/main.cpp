@@ -19,6 +19,7 @@
 							*/
 
 #include <iostream>
+#include <fstream>
 #include <string>
 
 #include "libavutil/ffversion.h"
@@ -30,7 +31,9 @@
 using namespace std;
 
 void usage() {
-	cerr << "Usage: untrunc [options] <ok.mp4> [corrupt.mp4]\n"
+	cerr << "Usage: untrunc [options] <ok.mp4> [corrupt.mp4 ...]\n"
+	     << "       corrupt.mp4 may be '-' (stdin) or a pipe, output then needs '-dst'\n"
+	     << "       several corrupt files are repaired in parallel, ok.mp4 is analyzed once\n"
 	     << "\ngeneral options:\n"
 	     << "-V  - version\n"
 	     << "-n  - no interactive\n" // in Mp4::analyze()
@@ -41,16 +44,30 @@ void usage() {
 	     << "-sv - stretches video to match audio duration (beta)\n"
 	     << "-rsv-ben - RSV file recovery (Sony recording-in-progress files)\n"
 	     << "-dw - don't write _fixed.mp4\n"
+	     << "-ip - repair in place: patch mdat, append moov to corrupt.mp4\n"
 	     << "-dr - dump repaired tracks, implies '-dw'\n"
 	     << "-k  - keep unknown sequences\n"
 	     << "-sm  - search mdat, even if no mp4-structure found\n"
 	     << "-dcc  - dont check if chunks are inside mdat\n"
 	     << "-dyn  - use dynamic stats\n"
 	     << "-range <A:B>  - raw data range\n"
-	     << "-dst <dir|file>  - set destination\n"
+	     << "-dst <dir|file>  - set destination, '-' for stdout\n"
 	     << "-skip  - skip existing\n"
 	     << "-noctts  - dont restore ctts\n"
 	     << "-mp <bytes>  - set max partsize\n"
+	     << "-nomm  - don't memory-map input files\n"
+	     << "-ra <bytes>  - prefetch input on a helper thread, implies '-nomm'\n"
+	     << "-nokc  - don't copy mdat in-kernel (copy_file_range/sendfile)\n"
+	     << "-fw <n>  - number of read buffers per file if not mapped (default 4)\n"
+	     << "-mem <bytes>  - memory budget for large buffers\n"
+	     << "-direct  - write output with O_DIRECT (bypass page cache)\n"
+	     << "-j <n>  - scan mdat segments with n threads\n"
+	     << "-beam <k>  - keep k candidate frame boundaries (hvc1)\n"
+	     << "-resume  - continue an interrupted repair from <output>.ckpt\n"
+	     << "           (not saved for '-j' or files with several mdats)\n"
+	     << "-ref <file>  - another healthy file of the same camera, repeatable\n"
+	     << "-idx  - also save the sample index to <output>.idx\n"
+	     << "-list <file>  - more corrupt files, one path per line\n"
 	     << "\n"
 	     << "analyze options:\n"
 	     << "-a  - analyze\n"
@@ -65,6 +82,11 @@ void usage() {
 	     << "-ms  - make streamable\n"
 	     << "-sh  - shorten\n"
 	     << "-u <mdat-file> <moov-file> - unite fragments\n"
+	     << "-mux <index> <ok.mp4> <corrupt.mp4> - write the video from a '-idx' index, without scanning\n"
+	     << "-drop <codec>  - leave out a track, used with '-mux'\n"
+	     << "-save-profile <file> <ok.mp4> - save what repairs need from ok.mp4\n"
+	     << "-profile <file> <corrupt.mp4> - repair with a saved profile instead of ok.mp4\n"
+	     << "-pick <dir> <corrupt.mp4> - repair with the best matching healthy file or profile in dir\n"
 	     << "\n"
 	     << "logging options:\n"
 	     << "-q  - quiet, only errors\n"
@@ -90,6 +112,15 @@ void parseRange(const string& s) {
 	g_range_end = s2.size() ? stoll(s2) : numeric_limits<int64_t>::max();
 }
 
+void readFileList(const string& fn, vector<string>& files) {
+	ifstream in(fn);
+	if (!in) logg(ET, "could not read '", fn, "'\n");
+	for (string line; getline(in, line);) {
+		trim_right(line);
+		if (line.size()) files.push_back(line);
+	}
+}
+
 int main(int argc, char *argv[]) {
 	const int kExpectArg = -22;
 	bool show_info = false;
@@ -110,6 +141,21 @@ int main(int argc, char *argv[]) {
 	int arg_range = -1;
 	int arg_dst = -1;
 	int arg_mp = -1;
+	int arg_ra = -1;
+	int arg_fw = -1;
+	int arg_mem = -1;
+	int arg_j = -1;
+	int arg_beam = -1;
+	int arg_mux = -1;
+	int arg_drop = -1;
+	int arg_save_profile = -1;
+	int arg_profile = -1;
+	int arg_pick = -1;
+	int arg_list = -1;
+	string mux_index, save_profile, profile, pick, file_list;
+	vector<string> drop_tracks;
+	int arg_ref = -1;
+	vector<string> refs;
 
 	argv_as_utf8(argc, argv);
 
@@ -121,8 +167,20 @@ int main(int argc, char *argv[]) {
 		if (arg_range == kExpectArg) {parseRange(arg); arg_range = -1; continue;}
 		if (arg_dst == kExpectArg) {g_dst_path = arg; arg_dst = -1; continue;}
 		if (arg_mp == kExpectArg) {parseMaxPartsize(arg); arg_mp = -1; continue;}
+		if (arg_ra == kExpectArg) {g_read_ahead = parseByteStr(arg); arg_ra = -1; continue;}
+		if (arg_fw == kExpectArg) {g_file_windows = stoi(arg); arg_fw = -1; continue;}
+		if (arg_mem == kExpectArg) {g_mem_budget = parseByteStr(arg); arg_mem = -1; continue;}
+		if (arg_j == kExpectArg) {g_threads = stoi(arg); arg_j = -1; continue;}
+		if (arg_beam == kExpectArg) {g_beam_width = stoi(arg); arg_beam = -1; continue;}
+		if (arg_mux == kExpectArg) {mux_index = arg; arg_mux = -1; continue;}
+		if (arg_drop == kExpectArg) {drop_tracks.push_back(arg); arg_drop = -1; continue;}
+		if (arg_save_profile == kExpectArg) {save_profile = arg; arg_save_profile = -1; continue;}
+		if (arg_profile == kExpectArg) {profile = arg; arg_profile = -1; continue;}
+		if (arg_pick == kExpectArg) {pick = arg; arg_pick = -1; continue;}
+		if (arg_list == kExpectArg) {file_list = arg; arg_list = -1; continue;}
+		if (arg_ref == kExpectArg) {refs.push_back(arg); arg_ref = -1; continue;}
 		if (arg == "--version") printVersion();
-		if (arg[0] == '-') {
+		if (arg[0] == '-' && arg != "-") {
 			auto a = arg.substr(1);
 			if      (a == "i") show_info = true;
 			else if (a == "it") show_tracks = true;
@@ -147,6 +205,7 @@ int main(int argc, char *argv[]) {
 			else if (a == "f") find_atoms = true;
 			else if (a == "do") g_dont_omit = true;
 			else if (a == "dw") g_dont_write = true;
+			else if (a == "ip") g_in_place = true;
 			else if (a == "dr") g_dump_repaired = true;
 			else if (a == "d") {dump_samples = true; g_log_mode = LogMode::E;}
 			else if (a == "m") {analyze_offset = true; arg_offset = kExpectArg; g_log_mode = LogMode::E;}
@@ -161,16 +220,44 @@ int main(int argc, char *argv[]) {
 			else if (a == "mp") arg_mp = kExpectArg;
 			else if (a == "dec") g_off_as_hex = false;
 			else if (a == "fa") g_fast_assert = true;
+			else if (a == "nomm") g_use_mmap = false;
+			else if (a == "ra") arg_ra = kExpectArg;
+			else if (a == "nokc") g_kernel_copy = false;
+			else if (a == "fw") arg_fw = kExpectArg;
+			else if (a == "mem") arg_mem = kExpectArg;
+			else if (a == "direct") g_direct_io = true;
+			else if (a == "j") arg_j = kExpectArg;
+			else if (a == "beam") arg_beam = kExpectArg;
+			else if (a == "resume") g_resume = true;
+			else if (a == "idx") g_write_index = true;
+			else if (a == "mux") arg_mux = kExpectArg;
+			else if (a == "drop") arg_drop = kExpectArg;
+			else if (a == "save-profile") arg_save_profile = kExpectArg;
+			else if (a == "profile") arg_profile = kExpectArg;
+			else if (a == "pick") arg_pick = kExpectArg;
+			else if (a == "list") arg_list = kExpectArg;
+			else if (a == "ref") arg_ref = kExpectArg;
 			else if (arg.size() > 2) {cerr << "Error: seperate multiple options with space! See '-h'\n";  return -1;}
 			else usage();
 		}
-		else if (argc > i+2) usage();  // too many arguments
 		else break;
 	}
-	if (argc == i) usage();  // no filename given
+	if (argc == i && (file_list.empty() || (profile.empty() && pick.empty()))) usage();  // no filename given
+	if (g_log_mode > kMaxLogMode) {
+		logg(W, "verbose logging is not compiled into this build, use 'make' instead of 'make untrunc-prod'\n");
+		g_log_mode = kMaxLogMode;
+	}
 
-	string ok = argv[i++], corrupt;
-	if (i < argc) corrupt = argv[i++];
+	string ok, corrupt;
+	if (profile.size() || pick.size()) {
+		if (profile.size() && pick.size()) usage();
+		ok = profile;
+	}
+	else ok = argv[i++];
+	vector<string> corrupts(argv + i, argv + argc);
+	if (file_list.size()) readFileList(file_list, corrupts);
+	if (corrupts.size()) corrupt = corrupts.front();
+	bool batch = corrupts.size() > 1;
 
 	g_show_tracks = show_tracks || show_info;
 
@@ -187,6 +274,36 @@ int main(int argc, char *argv[]) {
 			logg(ET, "'-rsv-ben' is not compatible with '-dyn'\n");
 	}
 
+	if (g_in_place) {
+		if (g_range_start != kRangeUnset)
+			logg(ET, "'-ip' is not compatible with '-range'\n");
+		if (g_dump_repaired)
+			logg(ET, "'-ip' is not compatible with '-dr'\n");
+		if (g_dst_path.size())
+			logg(ET, "'-ip' is not compatible with '-dst'\n");
+		if (g_direct_io)
+			logg(ET, "'-ip' is not compatible with '-direct'\n");
+	}
+
+	if (drop_tracks.size() && mux_index.empty())
+		logg(ET, "'-drop' needs '-mux'\n");
+	if (mux_index.size() && (g_resume || g_write_index || g_threads > 1))
+		logg(ET, "'-mux' does not scan, '-resume', '-idx' and '-j' make no sense with it\n");
+
+	if (batch) {
+		if (find_atoms || unite || shorten || listm || make_streamable || show_info || show_tracks || show_atoms ||
+		    show_stats || dump_samples || analyze || analyze_offset || mux_index.size() || save_profile.size())
+			logg(ET, "several corrupt files can only be repaired\n");
+		if (pick.size())
+			logg(ET, "'-pick' chooses for a single file, use '-profile' for several\n");
+	}
+
+	if (g_dst_path == "-") {
+		if (g_dump_repaired)
+			logg(ET, "'-dst -' is not compatible with '-dr'\n");
+		cout.rdbuf(cerr.rdbuf());  // stdout is reserved for the video
+	}
+
 	bool skip_info = find_atoms;
 	if (!skip_info) {
 		logg(I, g_version_str, '\n');
@@ -209,21 +326,26 @@ int main(int argc, char *argv[]) {
 			logg(I, "using step_size=", arg_step, "\n");
 			Mp4::step_ = arg_step;
 		}
+		if (pick.size()) ok = mp4.pickReference(pick, corrupt);
 
 		auto ext = getMovExtension(ok);
 		if (make_streamable) { mp4.makeStreamable(ok, ok + "_streamable" + ext); return 0; }
-		if (mp4.alreadyRepaired(ok, corrupt)) return 0;
+		if (!batch && mp4.alreadyRepaired(ok, corrupt)) return 0;
 
 		logg(I, "reading ", ok, '\n');
 		mp4.parseOk(ok, (show_atoms || show_info));
+		if (refs.size()) mp4.addReferences(refs);
 
-		if (show_tracks) mp4.printTracks();
+		if (save_profile.size()) mp4.saveProfile(save_profile);
+		else if (show_tracks) mp4.printTracks();
 		else if (show_atoms) mp4.printAtoms();
 		else if (show_stats) { g_use_chunk_stats = true; mp4.printStats(); }
 		else if (show_info) mp4.printMediaInfo();
 		else if (dump_samples) mp4.dumpSamples();
 		else if (analyze) mp4.analyze();
 		else if (analyze_offset) mp4.analyzeOffset(corrupt.empty() ? ok : corrupt, arg_offset);
+		else if (mux_index.size()) {chkC(); mp4.mux(corrupt, mux_index, drop_tracks);}
+		else if (batch) {if (!mp4.repairBatch(corrupts)) return 1;}
 		else if (corrupt.size()) mp4.repair(corrupt);
 	}
 	catch (const char* e) {return cerr << e << '\n', 1;}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <vector>
+
+#include "mp4.h"
+
+// per-offset results of the match functions and of predictSize, see Mp4::getMatch
+class MatchCache {
+public:
+	// predictSize also depends on the decoder and on where we are in the mdat
+	struct State {
+		int last_track_idx;
+		int64_t unknown_length;
+		uint64_t pkt_idx;
+		uint64_t next_chunk_idx;
+		bool operator==(const State& o) const {
+			return last_track_idx == o.last_track_idx && unknown_length == o.unknown_length &&
+			    pkt_idx == o.pkt_idx && next_chunk_idx == o.next_chunk_idx;
+		}
+	};
+
+	struct Entry {
+		off_t off = -1;
+		uint64_t known = 0, match = 0;  // matchSample, bit per track
+		uint64_t known_strict = 0, strict = 0;  // matchSampleStrict
+		uint64_t known_size = 0;  // predictSize, valid for state
+		State state;
+		std::vector<FrameInfo> sizes;
+	};
+
+	// results are only valid for one mdat
+	Entry& at(const void* mdat, off_t off) {
+		if (mdat != mdat_) {
+			for (auto& e : slots_) e.off = -1;
+			mdat_ = mdat;
+		}
+		auto& e = slots_[off % kSlots];
+		if (e.off != off) {
+			e.off = off;
+			e.known = e.known_strict = e.known_size = 0;
+		}
+		return e;
+	}
+
+	uint64_t hits_ = 0, misses_ = 0;
+	double hitRate() const { return hits_ + misses_ ? 100.0 * hits_ / (hits_ + misses_) : 0; }
+
+private:
+	static constexpr size_t kSlots = 1024;  // direct-mapped
+	Entry slots_[kSlots];
+	const void* mdat_ = nullptr;
+};
@@ -23,6 +23,7 @@
 #include <iomanip>  // setprecision
 #include <algorithm>
 #include <fstream>
+#include <mutex>
 
 extern "C" {
 #include <stdint.h>
@@ -34,15 +35,29 @@ extern "C" {
 #include "atom.h"
 #include "file.h"
 #include "rsv.h"
+#include "match_cache.h"
 
 using namespace std;
 
 uint64_t Mp4::step_ = 1;
 
+Mp4::Mp4() = default;
+
 Mp4::~Mp4() {
+	// workers, batch and library repairs create and destroy many instances
+	closeFiles();
+	for (auto& t : tracks_) avcodec_free_context(&t.codec_.av_codec_context_);
+	if (context_) avformat_close_input(&context_);
 	delete root_atom_;
 }
 
+void Mp4::closeFiles() {
+	delete current_mdat_;
+	delete current_file_;
+	current_mdat_ = nullptr;
+	current_file_ = nullptr;
+}
+
 void Mp4::parseHealthy() {
 	header_atom_ = root_atom_->atomByNameSafe("mvhd");
 	readHeaderAtom();
@@ -52,7 +67,7 @@ void Mp4::parseHealthy() {
 	av_register_all();
     #endif
 
-	unmute(); // sets AV_LOG_LEVEL
+	if (!g_muted) unmute(); // sets AV_LOG_LEVEL
 	context_ = avformat_alloc_context();
 	// Open video file
 	int error = avformat_open_input(&context_, filename_ok_.c_str(), NULL, NULL);
@@ -95,8 +110,10 @@ void Mp4::parseHealthy() {
 
 	for (uint i=0; i < tracks_.size(); i++)
 		if (contains({"twos", "sowt"}, tracks_[i].codec_.name_)) twos_track_idx_ = i;
+	if (twos_track_idx_ >= 0) twos_is_sowt_ = tracks_[twos_track_idx_].codec_.name_ == "sowt";
 	if (twos_track_idx_ >= 0 && hasCodec("avc1")) {
 		getTrack("avc1").codec_.chk_for_twos_ = true;
+		getTrack("avc1").codec_.twos_is_sowt_ = twos_is_sowt_;
 	}
 
 	if (g_log_mode >= LogMode::I) cout << '\n';
@@ -120,6 +137,8 @@ void Mp4::parseOk(const string& filename, bool accept_unhealthy) {
 		root_atom_->children_.push_back(atom);
 		if(file.atEnd()) break;
 	}
+	for (auto atom : root_atom_->atomsByName("free", true))
+		if (loadProfile(atom)) break;
 
 	if(root_atom_->atomByName("ctts"))
 		cerr << "Composition time offset atom found. Out of order samples possible." << endl;
@@ -167,6 +186,8 @@ void Mp4::parseOk(const string& filename, bool accept_unhealthy) {
 }
 
 void Mp4::parseTracksOk() {
+	static mutex codec_init_mutex;  // '-ref' parses on several threads
+	lock_guard<mutex> lock(codec_init_mutex);
 	Codec::initOnce();
 	auto mdats = root_atom_->atomsByName("mdat", true);
 	if (mdats.size() > 1)
@@ -193,6 +214,20 @@ void Mp4::parseTracksOk() {
 		logg(V, "ss: using manually specified: ", g_max_partsize, "\n");
 		max_part_size_ = g_max_partsize;
 	}
+	genPrefilter();
+}
+
+void Mp4::genPrefilter() {
+	prefilter_n_tracks_ = 0;
+	if (tracks_.size() > 64) return;
+	for (uint b=0; b < 256; b++) {
+		first_byte_tracks_[b] = 0;
+		for (uint i=0; i < tracks_.size(); i++) {
+			auto& c = tracks_[i].codec_;
+			if (c.sig_.allowsFirst(b)) first_byte_tracks_[b] |= 1ULL << i;
+		}
+	}
+	prefilter_n_tracks_ = tracks_.size();
 }
 
 
@@ -448,20 +483,28 @@ void Mp4::saveVideo(const string& filename) {
 	if (tracks_.back().is_dummy_) tracks_.pop_back();
 
 	if (g_log_mode >= I) {
-		cout << "Info: Found " << pkt_idx_ << " packets ( ";
+		string found = ss("Found ", pkt_idx_, " packets ( ");
 		for(const Track& t : tracks_){
-			cout << t.codec_.name_ << ": " << t.getNumSamples() << ' ';
+			found += ss(t.codec_.name_, ": ", t.getNumSamples(), ' ');
 			if (contains({"avc1", "hvc1", "hev1"}, t.codec_.name_) || t.keyframes_.size())
-				cout << ss(t.codec_.name_, "-keyframes: ", t.keyframes_.size(), " ");
+				found += ss(t.codec_.name_, "-keyframes: ", t.keyframes_.size(), " ");
 		}
-		cout << ")\n";
+		logg(I, found, ")\n");  // goes to g_onLog too
 	}
 
 	chkStrechFactor();
 	setDuration();
 
+	if (stream_out_) {
+		streamOut(current_mdat_->contentSize(), true);
+		if (stream_hdr_size_ + stream_emitted_ - current_mdat_->total_excluded_yet_ > 1LL<<32) {
+			broken_is_64_ = true;
+			logg(I, "using 64-bit offsets for the broken file\n");
+		}
+	}
+
 	for(Track& track : tracks_) {
-		track.applyExcludedToOffs();
+		if (!g_in_place) track.applyExcludedToOffs();
 		if (track.pkt_sz_gcd_ > 1 && g_dont_exclude) {
 			track.splitChunks();
 		}
@@ -490,18 +533,18 @@ void Mp4::saveVideo(const string& filename) {
 	delete original_mdat;
 //	Atom *mdat = root_atom_->atomByName("mdat");
 
-	if (unknown_lengths_.size()) {
+	if (unknown_seqs_.size()) {
 		cout << setprecision(4);
 		int64_t bytes_not_matched = 0;
-		for (auto n : unknown_lengths_) bytes_not_matched += n;
+		for (auto [off, n] : unknown_seqs_) bytes_not_matched += n;
 		double percentage = (double)100 * bytes_not_matched / mdat->contentSize();
-		logg(W, "Unknown sequences: ", unknown_lengths_.size(), '\n');
+		logg(W, "Unknown sequences: ", unknown_seqs_.size(), '\n');
 		logg(W, "Bytes NOT matched: ", pretty_bytes(bytes_not_matched), " (", percentage, "%)\n");
 	}
 
 	if (atoms_skipped_.size()) {
 		uint64_t sum = 0;
-		for (auto x : atoms_skipped_) sum += x;
+		for (auto [off, x] : atoms_skipped_) sum += x;
 
 		auto lvl = sum > 1 * (1<<20) ? W : V;
 		logg(lvl, "Skipped atoms in mdat: ", atoms_skipped_.size(), " -> ", pretty_bytes(sum), " total\n");
@@ -530,6 +573,15 @@ void Mp4::saveVideo(const string& filename) {
 		else it++;
 	}
 
+	if (g_in_place) {
+		saveVideoInPlace();
+		return;
+	}
+	if (stream_out_) {
+		finishStreamOut();
+		return;
+	}
+
 	//fix offsets
 	off_t offset = mdat->newHeaderSize() + moov->length_;
 	if(ftyp)
@@ -556,14 +608,188 @@ void Mp4::saveVideo(const string& filename) {
 		exit(0);
 	}
 
+	// ftyp + moov in one go
+	vector<uchar> head;
+	head.reserve((ftyp ? ftyp->length_ : 0) + moov->length_);
+	if(ftyp)
+		ftyp->serialize(head);
+	moov->serialize(head);
+	logg(V, "moov size: ", moov->length_, " (", pretty_bytes(moov->length_), ")\n");
+
 	//save to file
 	logg(I, "saving ", filename, '\n');
 	FileWrite file(filename);
+	if (g_direct_io && file.enableDirectIO()) {
+		off_t mdat_len = mdat->length_ - mdat->total_excluded_yet_ + (mdat->needs64bitVersion() ? 8 : 0);
+		file.preallocate(head.size() + mdat_len);
+	}
 
-	if(ftyp)
-		ftyp->write(file);
-	moov->write(file);
+	file.write(head);
 	mdat->write(file);
+	file.close();
+}
+
+void Mp4::startStreamOut(const string& filename) {
+	logg(I, "saving ", filename, " while reading\n");
+	stream_out_.reset(new FileWrite(filename));
+	if (stream_out_->isPipe())
+		logg(ET, "stream input can't be written to a pipe, the mdat size is only known at the end\n");
+
+	vector<uchar> head;
+	Atom *ftyp = root_atom_->atomByName("ftyp");
+	if (ftyp) ftyp->serialize(head);
+	stream_hdr_size_ = head.size() + 16;
+
+	uchar mdat_hdr[16] = {0, 0, 0, 1, 'm', 'd', 'a', 't'};  // size gets patched in the end
+	head.insert(head.end(), mdat_hdr, mdat_hdr + sizeof(mdat_hdr));
+	stream_out_->write(head);
+}
+
+// writes mdat content that can no longer become part of an excluded sequence
+void Mp4::streamOut(off_t offset, bool at_end) {
+	auto& mdat = *current_mdat_;
+	off_t horizon = offset;
+	if (!at_end && !g_dont_exclude) {
+		horizon -= unknown_length_;
+		if (idx_free_ >= 0 && tracks_[idx_free_].current_chunk_.n_samples_)
+			horizon = min(horizon, tracks_[idx_free_].current_chunk_.off_);
+	}
+	auto& excl = mdat.sequences_to_exclude_;
+	while (stream_emitted_ < horizon && (at_end || horizon - stream_emitted_ >= (1<<20))) {
+		off_t end = horizon;
+		if (stream_excl_idx_ < excl.size()) {
+			auto [start, len] = excl[stream_excl_idx_];
+			if (start < stream_emitted_)
+				logg(ET, "stream: sequence at ", offToStr(start), " was excluded after being written\n");
+			if (start == stream_emitted_) {
+				stream_emitted_ += len;
+				stream_excl_idx_++;
+				continue;
+			}
+			end = min(end, start);
+		}
+		int n = min<off_t>(end - stream_emitted_, 1<<20);
+		stream_out_->writeChar(mdat.getFragment(stream_emitted_, n), n);
+		stream_emitted_ += n;
+	}
+
+	// only unmatched data lies between horizon and offset, which is excluded anyway
+	off_t keep = max<off_t>(0, offset - max_part_size_);
+	if (stream_emitted_ < horizon) keep = min(keep, stream_emitted_);
+	mdat.file_read_.keepFrom(mdat.contentStart() + keep);
+}
+
+void Mp4::finishStreamOut() {
+	/* layout is ftyp, mdat, moov. The mdat content was already written by streamOut,
+	   only its header and the moov are left */
+	auto& mdat = *current_mdat_;
+	Atom *moov = root_atom_->atomByName("moov");
+	int64_t mdat_len = 16 + stream_emitted_ - mdat.total_excluded_yet_;
+
+	for (Track& track : tracks_) {
+		for (auto& c : track.chunks_) c.off_ += stream_hdr_size_;
+		track.saveChunkOffsets();
+	}
+
+	vector<uchar> buf;
+	moov->serialize(buf);
+	logg(V, "moov size: ", moov->length_, " (", pretty_bytes(moov->length_), ")\n");
+	stream_out_->write(buf);
+
+	stream_out_->seek(stream_hdr_size_ - 16 + 8);
+	stream_out_->writeInt64(mdat_len);
+	stream_out_->close();
+	stream_out_.reset();
+}
+
+void Mp4::saveVideoInPlace() {
+	/* the mdat content stays where it is, so chunk offsets only need the mdat position.
+	   mdat gets extended to EOF, the moov is appended behind it.
+	   excluded sequences are turned into 'free' atoms, each followed by a new mdat header
+	*/
+	auto& mdat = *current_mdat_;
+	auto& file_read = mdat.file_read_;
+	const string& filename = file_read.filename_;
+	off_t file_end = file_read.length();
+	Atom *moov = root_atom_->atomByName("moov");
+
+	if (mdat.start_ < 0 || string((char*)file_read.getFragment(mdat.start_ + 4, 4), 4) != "mdat")
+		logg(ET, "in-place repair needs an existing mdat header in '", filename, "'\n");
+	if (mdat.start_ < 8 || string((char*)file_read.getFragment(4, 4), 4) != "ftyp")
+		logg(ET, "'", filename, "' does not start with ftyp, repair it without '-ip'\n");
+
+	for (Track& track : tracks_) {
+		assert(track.chunks_.size(), track.codec_.name_, track.getNumSamples());
+		for (auto& c : track.chunks_) c.off_ += mdat.contentStart();
+		track.saveChunkOffsets();
+	}
+
+	auto fitsInto = [](uint64_t len, int hdr_sz) { return len == to_uint64(hdr_sz) || len >= to_uint64(hdr_sz) + 8; };
+	auto hdrSize = [](uint64_t seg_len) { return seg_len + 8 > UINT32_MAX ? 16 : 8; };
+
+	vector<pair<off_t, uint64_t>> splits;  // absolute
+	for (auto [start, len] : mdat.sequences_to_exclude_)
+		if (fitsInto(len, 8)) splits.emplace_back(mdat.contentStart() + start, len);
+
+	auto segEnd = [&](size_t i) { return i+1 < splits.size() ? splits[i+1].first : file_end; };
+	for (size_t i = 0; i < splits.size();) {
+		auto [start, len] = splits[i];
+		if (fitsInto(len, hdrSize(segEnd(i) - (start + len)))) i++;
+		else {  // previous segment gets longer, so check it again
+			splits.erase(splits.begin() + i);
+			if (i) i--;
+		}
+	}
+
+	off_t mdat_hdr_start = mdat.start_;
+	int mdat_hdr_sz = mdat.header_length_;
+	off_t first_end = splits.size() ? splits[0].first : file_end;
+	if (mdat_hdr_sz == 8 && first_end - mdat.start_ > UINT32_MAX) {
+		auto prev = mdat.start_ >= 8 ? file_read.getFragment(mdat.start_ - 8, 8) : nullptr;
+		if (prev && swap32(*(uint*)prev) == 8 && contains({"wide", "free", "skip"}, string((char*)prev+4, 4))) {
+			logg(V, "using preceding '", string((char*)prev+4, 4), "' for 64-bit mdat header\n");
+			mdat_hdr_start -= 8;
+			mdat_hdr_sz = 16;
+		}
+		else logg(ET, "mdat needs a 64-bit header, but there is no room for it. Repair without '-ip'\n");
+	}
+
+	logg(I, "repairing in place: ", filename, '\n');
+	FileWrite file(filename, true);
+
+	auto writeMdatHeader = [&](off_t at, int hdr_sz, uint64_t len) {
+		file.seek(at);
+		if (hdr_sz == 16) {
+			file.writeInt(1);
+			file.writeChar("mdat", 4);
+			file.writeInt64(len);
+		}
+		else {
+			file.writeInt(len);
+			file.writeChar("mdat", 4);
+		}
+	};
+
+	// moov first, the old mdat header stays valid until the very end
+	file.seek(file_end);
+	moov->write(file);
+
+	for (size_t i = 0; i < splits.size(); i++) {
+		auto [start, len] = splits[i];
+		off_t content_start = start + len;
+		int hdr_sz = hdrSize(segEnd(i) - content_start);
+		if (len > to_uint64(hdr_sz)) {
+			file.seek(start);
+			file.writeInt(len - hdr_sz);
+			file.writeChar("free", 4);
+		}
+		writeMdatHeader(content_start - hdr_sz, hdr_sz, segEnd(i) - (content_start - hdr_sz));
+	}
+	if (splits.size()) logg(I, "turned ", splits.size(), " excluded sequences into 'free' atoms\n");
+
+	writeMdatHeader(mdat_hdr_start, mdat_hdr_sz, first_end - mdat_hdr_start);
+	file.close();
+	logg(I, "appended moov at ", file_end, "\n");
 }
 
 string Mp4::getOutputSuffix() {
@@ -849,7 +1075,7 @@ void Mp4::genTrackOrder() {
 
 	track_order_simple_ = findOrderSimple(order);
 
-	if (g_log_mode >= LogMode::V) {
+	if (logEnabled(V)) {
 		_logg("order ( ", order.size(), "): ");
 		for (auto& p : order)
 			_logg("(", p.first, ", ", p.second, ") ");
@@ -875,14 +1101,22 @@ buffs_t Mp4::offsToBuffs(const offs_t& offs, const string& load_prefix) {
 	return buffs;
 }
 
-patterns_t Mp4::offsToPatterns(const offs_t& all_offs, const string& load_prefix) {
-	auto offs_to_consider = choose100(all_offs);
-	auto buffs = offsToBuffs(offs_to_consider, load_prefix);
-	auto patterns = genRawPatterns(buffs);
+// buffs are kept for '-save-profile' and workers, or come from the profile
+patterns_t Mp4::offsToPatterns(const offs_t& all_offs, const string& load_prefix, pair<int, int> transition) {
+	if (from_profile_ && !pattern_buffs_.count(transition))
+		logg(ET, "profile has no data for transition ", load_prefix, "save it again\n");
+	auto& buffs = pattern_buffs_[transition];
+	if (!buffs_given_) {
+		auto offs_to_consider = choose100(all_offs);
+		buffs.first = offsToBuffs(offs_to_consider, load_prefix);
 
-	auto offs_to_check = choose100(all_offs);
-	auto buffs2 = offsToBuffs(offs_to_check, load_prefix);
-	countPatternsSuccess(patterns, buffs2);
+		auto offs_to_check = choose100(all_offs);
+		buffs.second = offsToBuffs(offs_to_check, load_prefix);
+	}
+	auto all = buffs;  // gets shuffled
+	addRefPatternBuffs(transition, all);
+	auto patterns = genRawPatterns(all.first);
+	countPatternsSuccess(patterns, all.second);
 
 //	for (auto& p : patterns) cout << p.successRate() << " " << p << '\n';
 
@@ -897,7 +1131,7 @@ void Mp4::genDynPatterns() {
 		auto& patterns = tracks_[kv.first.first].dyn_patterns_[kv.first.second];
 		string prefix = ss(kv.first.first, "->", kv.first.second, ": ");
 
-		patterns = offsToPatterns(kv.second, prefix);
+		patterns = offsToPatterns(kv.second, prefix, kv.first);
 	}
 
 	for (auto& t: tracks_) {
@@ -912,7 +1146,7 @@ void Mp4::genDynPatterns() {
 void Mp4::addUnknownSequence(off_t start, uint64_t length) {
 	assert(length);
 	addToExclude(start, length);
-	unknown_lengths_.emplace_back(length);
+	unknown_seqs_.emplace_back(start, length);
 }
 
 void Mp4::addToExclude(off_t start, uint64_t length, bool force) {
@@ -934,9 +1168,9 @@ void Mp4::addToExclude(off_t start, uint64_t length, bool force) {
 	current_mdat_->total_excluded_yet_ += length;
 }
 
-FileRead& Mp4::openFile(const string& filename) {
+FileRead& Mp4::openFile(const string& filename, bool allow_stream) {
 	delete current_file_;
-	current_file_ = new FileRead(filename);
+	current_file_ = new FileRead(filename, allow_stream);
 	if (!current_file_->length())
 		throw length_error(ss("zero-length file: ", filename));
 	return *current_file_;
@@ -1051,7 +1285,8 @@ void Mp4::setDummyIsSkippable() {
 	logg(V, "running setDummyIsSkippable() ... \n");
 
 	dummy_is_skippable_ = false;
-	if (canSkipFree()) {
+	if (can_skip_free_ < 0) can_skip_free_ = canSkipFree();
+	if (can_skip_free_) {
 		logg(V, "yes, via canSkipFree\n");
 		dummy_is_skippable_ = true;
 	}
@@ -1285,6 +1520,19 @@ BufferedAtom* Mp4::findMdat(FileRead& file_read) {
 	return &mdat;
 }
 
+void Mp4::chkTableMemory() {
+	if (warned_table_mem_) return;
+	int64_t n = current_mdat_->sequences_to_exclude_.capacity() * sizeof(current_mdat_->sequences_to_exclude_[0]);
+	for (auto& t : tracks_) {
+		n += (t.sizes_.capacity() + t.times_.capacity() + t.keyframes_.capacity()) * sizeof(int);
+		n += t.chunks_.capacity() * sizeof(Track::Chunk);
+	}
+	if (n > memAvailable()) {
+		logg(W, "sample tables use ", pretty_bytes(n), ", more than what is left of '-mem'\n");
+		warned_table_mem_ = true;
+	}
+}
+
 void Mp4::addFrame(const FrameInfo& fi) {
 	Track& track = tracks_[fi.track_idx_];
 	track.num_samples_++;
@@ -1312,6 +1560,8 @@ void Mp4::addChunk(const Mp4::Chunk& chunk) {
 }
 
 const uchar* Mp4::loadFragment(off_t offset, bool update_cur_maxlen) {
+	if (current_mdat_->file_read_.isStream())  // so that EOF is known
+		current_mdat_->file_read_.prefetch(current_mdat_->contentStart() + offset + max((uint)g_max_buf_sz_needed, max_part_size_));
 	if (update_cur_maxlen)
 		current_maxlength_ = min((int64_t) max_part_size_, current_mdat_->contentSize() - offset);
 	auto buf_sz = min((int64_t) g_max_buf_sz_needed, current_mdat_->contentSize() - offset);
@@ -1400,13 +1650,14 @@ bool Mp4::wouldMatch(const WouldMatchCfg& cfg) {
 	};
 
 	auto start = loadFragment(cfg.offset);
+	auto cand = candidateTracks(start);
 	for (uint i=0; i < tracks_.size(); i++) {
+		if (i < 64 && !(cand >> i & 1)) continue;
 		auto& c = tracks_[i].codec_;
 		if (cfg.very_first && orig_first_track_->codec_.name_ != c.name_) continue;
 		bool be_strict = cfg.force_strict || shouldBeStrict(cfg.offset, i);
 		if (tracks_[i].codec_.name_ == cfg.skip) continue;
-		if (be_strict && !c.matchSampleStrict(start)) continue;
-		if (!be_strict && !c.matchSample(start)) continue;
+		if (!cachedMatch(cfg.offset, start, i, be_strict)) continue;
 
 
 		logg(V, "wouldMatch(", cfg, ") -> yes, ", c.name_, "\n");
@@ -1437,10 +1688,62 @@ bool Mp4::wouldMatch(const WouldMatchCfg& cfg) {
 }
 
 bool Mp4::wouldMatch2(const uchar *start) {
-	for (auto& t : tracks_) if (t.codec_.matchSample(start)) return true;
+	auto cand = candidateTracks(start);
+	for (uint i=0; i < tracks_.size(); i++) {
+		if (i < 64 && !(cand >> i & 1)) continue;
+		if (tracks_[i].codec_.matchSample(start)) return true;
+	}
 	return false;
 }
 
+MatchCache& Mp4::matchCache() {
+	if (!match_cache_) match_cache_.reset(new MatchCache);
+	return *match_cache_;
+}
+
+bool Mp4::cachedMatch(off_t offset, const uchar* start, uint track_idx, bool strict) {
+	auto& c = tracks_[track_idx].codec_;
+	if (track_idx >= 64) return strict ? c.matchSampleStrict(start) : c.matchSample(start);
+
+	auto& mc = matchCache();
+	auto& e = mc.at(current_mdat_, offset);
+	auto bit = 1ULL << track_idx;
+	auto& known = strict ? e.known_strict : e.known;
+	auto& res = strict ? e.strict : e.match;
+	if (known & bit) {
+		mc.hits_++;
+		return res & bit;
+	}
+	mc.misses_++;
+	bool r = strict ? c.matchSampleStrict(start) : c.matchSample(start);
+	known |= bit;
+	res = r ? res | bit : res & ~bit;
+	return r;
+}
+
+FrameInfo Mp4::cachedPredictSize(off_t offset, const uchar* start, uint track_idx) {
+	if (track_idx >= 64) return predictSize(start, track_idx, offset);
+
+	auto& mc = matchCache();
+	auto& e = mc.at(current_mdat_, offset);
+	MatchCache::State state{last_track_idx_, unknown_length_, pkt_idx_, next_chunk_idx_};
+	if (!(e.state == state)) {
+		e.state = state;
+		e.known_size = 0;
+	}
+	auto bit = 1ULL << track_idx;
+	if (e.known_size & bit) {
+		mc.hits_++;
+		return e.sizes[track_idx];
+	}
+	mc.misses_++;
+	auto r = predictSize(start, track_idx, offset);
+	if (e.sizes.size() < tracks_.size()) e.sizes.resize(tracks_.size());
+	e.sizes[track_idx] = r;
+	e.known_size |= bit;
+	return r;
+}
+
 FrameInfo Mp4::predictSize(const uchar *start, int track_idx, off_t offset) {
 	auto& track = tracks_[track_idx];
 	Codec& c = track.codec_;
@@ -1511,7 +1814,9 @@ FrameInfo Mp4::getMatch(off_t offset, bool force_strict) {
 		}
 	}
 
+	auto cand = candidateTracks(start);
 	for (uint i=0; i < tracks_.size(); i++) {
+		if (i < 64 && !(cand >> i & 1)) continue;
 		auto& track = tracks_[i];
 		Codec& c = track.codec_;
 		logg(V, "Track codec: ", c.name_, '\n');
@@ -1521,11 +1826,9 @@ FrameInfo Mp4::getMatch(off_t offset, bool force_strict) {
 		}
 
 		bool be_strict = force_strict || shouldBeStrict(offset, i);
+		if (!cachedMatch(offset, start, i, be_strict)) continue;
 
-		if (be_strict && !c.matchSampleStrict(start)) continue;
-		if (!be_strict && !c.matchSample(start)) continue;
-
-        auto m = predictSize(start, i, offset);
+		auto m = cachedPredictSize(offset, start, i);
 		if (!m) continue;
 		return m;
 	}
@@ -1559,7 +1862,7 @@ bool Mp4::anyPatternMatchesHalf(off_t offset, uint track_idx_to_try) {
 
 	for (auto& t : tracks_) {
 		for (auto& p : t.dyn_patterns_[track_idx_to_try]) {
-			if (g_log_mode >= V) {
+			if (logEnabled(V)) {
 				cout << string(36, ' ');
 				printBuffer(buff, Mp4::pat_size_);
 				cout << p << '\n';
@@ -1983,8 +2286,12 @@ bool Mp4::advanceOffset(off_t& offset, bool just_simulate) {
 		auto start = loadFragment(offset);
 		uint begin = *(uint*)start;
 
-		static uint loop_cnt = 0;
-		if (g_log_mode == I && loop_cnt++ % 2000 == 0) outProgress(offset, current_mdat_->file_end_);
+		static thread_local uint loop_cnt = 0;
+		if (loop_cnt++ % 2000 == 0) {
+			chkCancelled();
+			if (g_log_mode == I && !current_mdat_->file_read_.isStream())
+				outProgress(offset, current_mdat_->file_end_);
+		}
 
 		if ((skipped = skipZeros(offset, start))) {
 			if (padding > 0) {  // we assume that if file uses padding, zeros might be part of payload
@@ -2003,7 +2310,7 @@ bool Mp4::advanceOffset(off_t& offset, bool just_simulate) {
 
 		if ((skipped = skipAtoms(offset, start))) {
 			if (!just_simulate) {
-				atoms_skipped_.emplace_back(skipped);
+				atoms_skipped_.emplace_back(offset, skipped);
 				chkUnknownSequenceEnded(offset);
 			}
 			continue;
@@ -2012,7 +2319,7 @@ bool Mp4::advanceOffset(off_t& offset, bool just_simulate) {
 		break;
 	}
 
-	if (g_log_mode >= LogMode::V) {
+	if (logEnabled(V)) {
 		if (just_simulate) {
 			logg(V, "\n(reading element from mdat - simulate)\n");
 		} else {
@@ -2184,6 +2491,7 @@ void Mp4::addMatch(off_t& offset, FrameInfo& match) {
 	if (!t.is_dummy_) {
 		addFrame(match);
 		pkt_idx_++;
+		if (g_mem_budget && !(pkt_idx_ & 0xffff)) chkTableMemory();
 	}
 
 	t.current_chunk_.n_samples_++;
@@ -2213,7 +2521,8 @@ string rewriteDestination(const std::string& dst) {
 }
 
 string Mp4::getPathRepaired(const std::string& ok, const std::string& corrupt) {
-	auto filename_fixed = corrupt + "_fixed" + getOutputSuffix() + getMovExtension(ok);
+	auto ext = from_profile_ && ok == filename_ok_ ? ok_ext_ : getMovExtension(ok);
+	auto filename_fixed = corrupt + "_fixed" + getOutputSuffix() + ext;
 	return rewriteDestination(filename_fixed);
 }
 
@@ -2244,24 +2553,54 @@ bool Mp4::setDuplicateInfo() {
 	return foundAny;
 }
 
-void Mp4::repair(const string& filename) {
-	if (chkBadFFmpegVersion()) {
-		return;
-	}
+off_t Mp4::findStartOffset() {
+	off_t offset = 0;
 
-	// Check for RSV Ben mode
-	if (g_rsv_ben_mode) {
-		FileRead file_read(filename);
-		if (!isPointingAtRtmdHeader(file_read)) {
-			logg(W, "'-rsv-ben' specified but file does not start with rtmd header\n");
+	if (g_use_chunk_stats) {
+		off_t start_off = 0;
+
+		auto first_off_abs = first_off_abs_ - current_mdat_->contentStart();
+		if (first_off_abs > 0 && wouldMatch(WMCfg{first_off_abs})) {
+			dbgg("set start offset via", first_off_abs_, first_off_abs);
+			offset = first_off_abs;
+		}
+		else if (first_off_rel_ ) {
+			if (wouldMatch(WMCfg{.offset=first_off_rel_, .very_first=true})) {
+				dbgg("set start offset via", first_off_rel_);
+				offset = first_off_rel_;
+			} else {
+				start_off = offset;
+				advanceOffset(start_off, true);  // some atom (e.g. wide) might get skipped
+				if (start_off && wouldMatch(WMCfg{.offset=start_off + first_off_rel_, .very_first=true})) {
+					dbgg("set start offset via rel2", start_off, first_off_rel_);
+					offset = start_off + first_off_rel_;
+				}
+			}
+		}
+
+		if (offset) {
+			logg(V, "beginning at offset ", offToStr(offset), " instead of 0\n");
+			addUnknownSequence(start_off, offset);
 		}
-		repairRsvBen(filename);
-		return;
 	}
+	return offset;
+}
 
-	use_offset_map_ = use_offset_map_ || filename == filename_ok_;
-	if (use_offset_map_) analyze(true);
+void Mp4::setPrematureEnd(off_t offset) {
+	auto mdat = current_mdat_;
+	double percentage = (double)100 * offset / mdat->contentSize();
+	mdat->file_end_ = toAbsOff(offset);
+	mdat->length_ = offset + 8;
+
+	logg(E, "unable to find correct codec -> premature end", " (~", setprecision(4), percentage, "%)\n",
+	"       try '-s' to skip unknown sequences\n\n");
+	logg(V, "mdat->file_end: ", mdat->file_end_, '\n');
+
+	premature_percentage_ = percentage; premature_end_ = true;
+}
 
+// track statistics needed for scanning, independent of the corrupt file
+void Mp4::prepareRepair() {
 	if (needDynStats()) {
 		g_use_chunk_stats = true;
 		genDynStats();
@@ -2275,7 +2614,7 @@ void Mp4::repair(const string& filename) {
 		}
 	}
 
-	if (g_log_mode >= LogMode::V) printStats();
+	if (logEnabled(V)) printStats();
 
 	if (!g_ignore_unknown && max_part_size_ < g_max_partsize_default) {
 		double x = (double)max_part_size_ / g_max_partsize_default;
@@ -2284,60 +2623,21 @@ void Mp4::repair(const string& filename) {
 	}
 	logg(V, "ss: max_part_size_: ", max_part_size_, "\n");
 
-	if (alreadyRepaired(filename_ok_, filename)) exit(0);
-
 	fallback_track_idx_ = calcFallbackTrackIdx();
 	logg(V, "fallback: ", fallback_track_idx_, "\n");
+	genPrefilter();  // the dummy track might have been added
+}
 
-	auto& file_read = openFile(filename);
-
-	// TODO: What about multiple mdat?
-
-	logg(V, "calling findMdat on truncated file..\n");
-	auto mdat = findMdat(file_read);
-	logg(I, "reading mdat from truncated file ...\n");
-
-	if (file_read.length() > (1LL<<32)) {
-		broken_is_64_ = true;
-		logg(I, "using 64-bit offsets for the broken file\n");
-	}
-
-	duration_ = 0;
-	for(uint i=0; i < tracks_.size(); i++)
-		tracks_[i].clear();
-
-	off_t offset = 0;
-
-	if (g_use_chunk_stats) {
-		off_t start_off = 0;
-
-		auto first_off_abs = first_off_abs_ - mdat->contentStart();
-		if (first_off_abs > 0 && wouldMatch(WMCfg{first_off_abs})) {
-			dbgg("set start offset via", first_off_abs_, first_off_abs);
-			offset = first_off_abs;
-		}
-		else if (first_off_rel_ ) {
-			if (wouldMatch(WMCfg{.offset=first_off_rel_, .very_first=true})) {
-				dbgg("set start offset via", first_off_rel_);
-				offset = first_off_rel_;
-			} else {
-				start_off = offset;
-				advanceOffset(start_off, true);  // some atom (e.g. wide) might get skipped
-				if (start_off && wouldMatch(WMCfg{.offset=start_off + first_off_rel_, .very_first=true})) {
-					dbgg("set start offset via rel2", start_off, first_off_rel_);
-					offset = start_off + first_off_rel_;
-				}
-			}
-		}
-
-		if (offset) {
-			logg(V, "beginning at offset ", offToStr(offset), " instead of 0\n");
-			addUnknownSequence(start_off, offset);
-		}
-	}
+void Mp4::scanSequential() {
+	off_t offset = findStartOffset();
+	if (g_resume && !ckpt_path_.empty()) loadCheckpoint(offset);
 
 	while (chkOffset(offset)) {
-		if (tryAll(offset)) continue;
+		if (stream_out_) streamOut(offset);
+		if (tryAll(offset)) {
+			maybeCheckpoint(offset);
+			continue;
+		}
 
 		if (!unknown_length_) {
 			pushBackLastChunk();
@@ -2357,29 +2657,85 @@ void Mp4::repair(const string& filename) {
 			}
 
 			auto step = calcStep(offset);
+			step += resyncDistance(offset + step);
 			unknown_length_ += step;
 			offset += step;
 		}
 		else {
 			if (g_muted) unmute();
-			double percentage = (double)100 * offset / mdat->contentSize();
-			mdat->file_end_ = toAbsOff(offset);
-			mdat->length_ = offset + 8;
+			setPrematureEnd(offset);
+			break;
+		}
+	}
+}
 
-			logg(E, "unable to find correct codec -> premature end", " (~", setprecision(4), percentage, "%)\n",
-			"       try '-s' to skip unknown sequences\n\n");
-			logg(V, "mdat->file_end: ", mdat->file_end_, '\n');
+void Mp4::repair(const string& filename) {
+	if (chkBadFFmpegVersion()) {
+		return;
+	}
 
-			premature_percentage_ = percentage; premature_end_ = true;
-			break;
+	// Check for RSV Ben mode
+	if (g_rsv_ben_mode) {
+		FileRead file_read(filename);
+		if (!isPointingAtRtmdHeader(file_read)) {
+			logg(W, "'-rsv-ben' specified but file does not start with rtmd header\n");
 		}
+		repairRsvBen(filename);
+		return;
 	}
 
+	use_offset_map_ = use_offset_map_ || filename == filename_ok_;
+	if (use_offset_map_) analyze(true);
+
+	prepareRepair();
+	if (alreadyRepaired(filename_ok_, filename)) return;
+
+	auto& file_read = openFile(filename, true);
+
+	logg(V, "calling findMdat on truncated file..\n");
+	findMdat(file_read);
+	logg(I, "reading mdat from truncated file ...\n");
+
+	if (file_read.isStream()) {
+		if (g_in_place || g_range_start != kRangeUnset || g_dump_repaired)
+			logg(ET, "'-ip', '-range' and '-dr' need a seekable input file\n");
+		if (filename == "-" && g_dst_path.empty() && !g_dont_write)
+			logg(ET, "reading from stdin needs an output file, use '-dst'\n");
+		if (!g_dont_write) startStreamOut(getPathRepaired(filename_ok_, filename));
+	}
+	else if (file_read.length() > (1LL<<32)) {
+		broken_is_64_ = true;
+		logg(I, "using 64-bit offsets for the broken file\n");
+	}
+	// checkpoints only make sense if there is an output to resume into
+	if (!file_read.isStream() && !use_offset_map_ && !g_dont_write && !g_dump_repaired) {
+		auto out = g_in_place ? filename : getPathRepaired(filename_ok_, filename);
+		if (out != "-") ckpt_path_ = out + ".ckpt";
+	}
+	if (g_resume && ckpt_path_.empty())
+		logg(ET, "'-resume' needs a seekable input file and an output file\n");
+
+	duration_ = 0;
+	for(uint i=0; i < tracks_.size(); i++)
+		tracks_[i].clear();
+
+	if (!scanMdats(filename) && !scanParallel(filename)) scanSequential();
+
 	if (g_muted) unmute();
 
+	if (!file_read.isMapped())
+		logg(V, "read buffers: ", file_read.cacheHits(), " hits, ", file_read.cacheMisses(), " misses\n");
+	if (match_cache_)
+		logg(V, "match cache: ", match_cache_->hits_, " hits, ", match_cache_->misses_, " misses (",
+		     setprecision(3), match_cache_->hitRate(), "%)\n");
+
 	for (auto& track : tracks_) track.fixTimes();
 
 	auto filename_fixed = getPathRepaired(filename_ok_, filename);
+	vector<uchar> index;
+	if (g_write_index) index = makeIndex();
 	saveVideo(filename_fixed);
+	if (g_write_index) writeIndex(filename_fixed + ".idx", index);  // only describes written output
+	removeCheckpoint();
 }
 
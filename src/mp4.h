@@ -25,15 +25,21 @@
 #include <string>
 #include <stdio.h>
 #include <memory>
+#include <functional>
+#include <time.h>
 
 #include "common.h"
 #include "track.h"
 #include "atom.h"
 class FileRead;
 class AVFormatContext;
+class MatchCache;
+class BinWriter;
+class BinReader;
 class FrameInfo;
 class ChunkIt;
 struct TrackGcdInfo;
+struct PickScore;
 
 struct WouldMatchCfg {
 	off_t offset;
@@ -70,7 +76,7 @@ friend Track;
 friend Codec;
 friend ChunkIt;
 public:
-    Mp4() = default;
+	Mp4();
 	~Mp4();
 
 	void parseOk(const std::string& filename, bool accept_unhealthy=false); // parse the first file
@@ -89,14 +95,23 @@ public:
 
 	void dumpSamples();
 	void analyze(bool gen_off_map=false);
+	void prepareRepair();  // analysis of the healthy file, done by repair()
 	void repair(const std::string& filename);
+	bool repairBatch(const std::vector<std::string>& filenames);  // see batch.cpp
+	std::unique_ptr<Mp4> repairCopy(const std::string& filename, bool single_threaded=false);
 	void repairRsvBen(const std::string& filename);
+	void mux(const std::string& filename, const std::string& index_fn, const std::vector<std::string>& drop={});
+	void saveProfile(const std::string& path);
+	void addReferences(const std::vector<std::string>& filenames);
+	std::string pickReference(const std::string& dir, const std::string& corrupt);  // see pick.cpp
 
 	bool wouldMatch(const WouldMatchCfg& cfg);
 	bool wouldMatch2(const uchar* start);
 	bool wouldMatchDyn(off_t offset, int last_idx);
 	FrameInfo predictSize(const uchar *start, int track_idx, off_t offset);
 	FrameInfo getMatch(off_t offset, bool force_strict=false);
+	bool cachedMatch(off_t offset, const uchar* start, uint track_idx, bool strict);
+	FrameInfo cachedPredictSize(off_t offset, const uchar* start, uint track_idx);
 	void analyzeOffset(const std::string& filename, off_t offset);
 
 	bool hasCodec(const std::string& codec_name);
@@ -143,6 +158,8 @@ public:
 	void onFirstChunkFound(int track_idx);
 	void correctChunkIdxSimple(int track_idx);
 
+	int beamSearchSize(Codec* self, const std::vector<int>& sizes);  // '-beam', see beam.cpp
+
 	// Note: An backtrack algo across multiple (e.g. track_order.size()) matches would be better than this, since it would work even if currentChunkFinished + we wouldn't have to check upfront
 	int findSizeWithContinuation(off_t off, std::vector<int> sizes) {
 		if (!track_order_.size() || amInFreeSequence() || currentChunkFinished(1)) {
@@ -167,7 +184,86 @@ private:
 	static BufferedAtom* mdatFromRange(FileRead& file_read, BufferedAtom& mdat);
 	static bool findAtom(FileRead& file_read, std::string atom_name, Atom& atom);
 	BufferedAtom* findMdat(FileRead& file_read);
-	AVFormatContext *context_;
+	void saveVideoInPlace();
+	AVFormatContext *context_ = nullptr;
+
+
+	// tracks which could match, judging by the first bytes (see CodecSig)
+	uint64_t first_byte_tracks_[256];
+	size_t prefilter_n_tracks_ = 0;  // 0 = not built
+	void genPrefilter();
+	std::unique_ptr<MatchCache> match_cache_;
+	MatchCache& matchCache();
+	uint64_t candidateTracks(const uchar* start) {
+		if (prefilter_n_tracks_ != tracks_.size()) return ~0ULL;
+		uint64_t cand = first_byte_tracks_[start[0]];
+		uint64_t head = swap64(*(uint64_t*)start);
+		for (uint64_t x = cand; x; x &= x - 1) {
+			auto& sig = tracks_[__builtin_ctzll(x)].codec_.sig_;
+			if ((head & sig.mask_) != sig.value_) cand &= ~(x & -x);
+		}
+		return cand;
+	}
+	off_t findStartOffset();
+	void scanSequential();
+	void setPrematureEnd(off_t offset);
+
+	// '-j' and multiple mdats: parts of the mdat(s) are scanned by independent Mp4 instances
+	std::vector<off_t> fatal_unknowns_;  // would end a scan without '-s'
+	bool scanParallel(const std::string& filename);
+	bool scanMdats(const std::string& filename);  // one worker per mdat
+	std::vector<std::pair<off_t, off_t>> mdatContents();
+	void scanSegment(off_t start, off_t stop, off_t lenient_end);
+	off_t findSyncOffset(Mp4& next, off_t from);
+	void mergeSegment(Mp4& w, off_t lo, off_t hi);
+	std::unique_ptr<Mp4> newWorker(const std::string& filename);
+	std::unique_ptr<Mp4> cloneAnalyzed();  // parses the healthy file again, reuses what was read from its mdat
+	bool single_threaded_ = false;  // batch workers, the batch itself is parallel
+	void runWorkers(std::vector<std::unique_ptr<Mp4>>& workers, const std::function<void(Mp4&, int)>& fn);
+	static void closeWorkers(std::vector<std::unique_ptr<Mp4>>& workers);
+	void closeFiles();  // mapping, buffers and read-ahead of the file opened last
+
+	// scan state is saved periodically, '-resume' continues from it (see checkpoint.cpp)
+	std::string ckpt_path_;
+	time_t ckpt_last_ = 0;
+	uint ckpt_cnt_ = 0;
+	std::string indexKey();
+	std::string checkpointKey();
+	void putScanResults(BinWriter& w);
+	void getScanResults(BinReader& r);
+	void maybeCheckpoint(off_t offset);
+	void saveCheckpoint(off_t offset);
+	bool loadCheckpoint(off_t& offset);
+	void removeCheckpoint();
+
+	// healthy file without its mdat, read by parseOk() (see profile.cpp)
+	bool from_profile_ = false;
+	std::string ok_ext_;  // of the original healthy file
+	int can_skip_free_ = -1;  // cached canSkipFree()
+	bool buffs_given_ = false;  // pattern_buffs_ come from a profile or another instance
+	std::map<std::pair<int, int>, std::pair<buffs_t, buffs_t>> pattern_buffs_;  // transition -> pattern, check buffers
+	bool loadProfile(Atom* atom);  // if atom holds one
+
+	// '-ref': more healthy files of the same camera (see references.cpp)
+	std::vector<std::shared_ptr<Mp4>> refs_;
+	std::vector<std::vector<int>> ref_track_idx_;  // [ref][own track_idx] -> track_idx in ref, or -1
+	void useReferences();
+	void addRefPatternBuffs(std::pair<int, int> transition, std::pair<buffs_t, buffs_t>& buffs);
+	void scoreAsReference(PickScore& s, const std::string& corrupt_brand);  // '-pick'
+
+	// '-idx' saves the scan results, '-mux' writes a video from them (see index.cpp)
+	std::vector<uchar> makeIndex();  // before saveVideo(), which changes the offsets
+	void writeIndex(const std::string& path, const std::vector<uchar>& data);
+	bool loadIndex(const std::string& path);  // returns whether it was made with '-k'
+
+	// stream input: mdat content is written while scanning, moov goes last
+	std::unique_ptr<FileWrite> stream_out_;
+	int64_t stream_hdr_size_ = 0;  // ftyp + 16 byte mdat header
+	off_t stream_emitted_ = 0;  // relative to mdat content, including exclusions
+	size_t stream_excl_idx_ = 0;
+	void startStreamOut(const std::string& filename);
+	void streamOut(off_t offset, bool at_end=false);
+	void finishStreamOut();
 
 	void parseHealthy();
 	void parseTracksOk();
@@ -186,9 +282,11 @@ private:
 	const uchar* loadFragment(off_t offset, bool update_cur_maxlen=true);
 	bool broken_is_64_ = false;
 	int64_t unknown_length_ = 0;
-	std::vector<uint> atoms_skipped_;
+	std::vector<std::pair<off_t, uint>> atoms_skipped_;
 
 	uint64_t pkt_idx_ = 0;
+	bool warned_table_mem_ = false;
+	void chkTableMemory();
 
 	// 0th track is most reliable
 	// is equal to idx_free_ in case of unknown bytes, not padding
@@ -201,7 +299,7 @@ private:
 		done_padding_ = false;
 	}
 
-	std::vector<int64_t> unknown_lengths_;
+	std::vector<std::pair<off_t, int64_t>> unknown_seqs_;
 
 	std::string filename_ok_;
 	bool use_offset_map_ = false;
@@ -229,7 +327,7 @@ private:
 	std::map<std::pair<int, int>, std::vector<off_t>> chunk_transitions_;
 
 	buffs_t offsToBuffs(const offs_t& offs, const std::string& load_prefix);
-	patterns_t offsToPatterns(const offs_t& offs, const std::string& load_prefix);
+	patterns_t offsToPatterns(const offs_t& offs, const std::string& load_prefix, std::pair<int, int> transition);
 
 	bool calcTransitionIsUnclear(int track_idx_a, int track_idx_b);
 	void setHasUnclearTransition() {
@@ -255,7 +353,7 @@ private:
 		disableNoiseBuffer();
 
 		addToExclude(offset-unknown_length_, unknown_length_);
-		unknown_lengths_.emplace_back(unknown_length_);
+		unknown_seqs_.emplace_back(offset-unknown_length_, unknown_length_);
 		unknown_length_ = 0;
 
 		return true;
@@ -273,13 +371,14 @@ private:
 	}
 
 	int64_t calcStep(off_t offset);
+	int64_t resyncDistance(off_t offset);  // bytes inside an unknown sequence that can't end it
 
 	const std::vector<std::string> ignore_duration_ = {"tmcd", "fdsc"};
 
 	uint current_maxlength_;
 	BufferedAtom* current_mdat_ = nullptr;
 
-	FileRead& openFile(const std::string& filename);
+	FileRead& openFile(const std::string& filename, bool allow_stream=false);
 	FileRead* current_file_ = nullptr;
 
 	bool predictChunkViaOrder(off_t offset, Mp4::Chunk& c);
@@ -392,6 +491,7 @@ private:
 	}
 
 	int twos_track_idx_ = -1;
+	bool twos_is_sowt_ = false;
 	bool using_dyn_patterns_ = false;
 
 	uint max_part_size_ = 0;
@@ -0,0 +1,311 @@
+#include <thread>
+#include <functional>
+#include <set>
+#include <exception>
+
+#include "mp4.h"
+#include "atom.h"
+#include "file.h"
+#include "common.h"
+#include "match_cache.h"
+
+using namespace std;
+
+/* '-j': the mdat is split into segments, each scanned by its own Mp4 instance.
+   A worker resyncs at its segment start and keeps scanning into the next segment,
+   until a chunk start both workers agree on is found. Results are stitched there.
+*/
+bool Mp4::scanParallel(const string& filename) {
+	if (g_threads < 2 || single_threaded_ || use_offset_map_ || g_dump_repaired || stream_out_) return false;
+	if (g_resume) {
+		logg(I, "resuming scans sequentially, ignoring '-j'\n");
+		return false;
+	}
+
+	int64_t content_size = current_mdat_->contentSize();
+	int64_t overlap = max<int64_t>(32<<20, 16 * (int64_t)max_part_size_);
+	int n = min<int64_t>(g_threads, content_size / (4 * overlap));
+	if (n < 2) {
+		logg(V, "mdat too small to be scanned in parallel\n");
+		return false;
+	}
+	logg(I, "scanning mdat with ", n, " threads\n");
+
+	auto orig_log_mode = g_log_mode;
+	g_log_mode = min(g_log_mode, W);
+	vector<unique_ptr<Mp4>> workers;
+	vector<off_t> seg_start;
+	for (int i=0; i < n; i++) {
+		seg_start.push_back(content_size / n * i);
+		workers.push_back(newWorker(filename));
+	}
+
+	runWorkers(workers, [&](Mp4& w, int i) {
+		off_t start = seg_start[i];
+		off_t stop = i+1 < n ? seg_start[i+1] + overlap : content_size;
+		w.scanSegment(start, stop, i ? start + overlap : 0);
+	});
+	g_log_mode = orig_log_mode;
+
+	// each worker contributes [lo, hi)
+	vector<pair<off_t, off_t>> parts;
+	off_t lo = 0, premature = -1;
+	for (int i=0; i < n; i++) {
+		auto& w = *workers[i];
+		off_t hi = i+1 < n ? w.findSyncOffset(*workers[i+1], seg_start[i+1]) : content_size;
+		if (!g_ignore_unknown) {
+			auto& fu = w.fatal_unknowns_;
+			auto it = lower_bound(fu.begin(), fu.end(), lo);
+			if (it != fu.end() && (hi < 0 || *it < hi)) premature = hi = *it;
+		}
+		if (hi < 0) {
+			logg(W, "could not stitch segments at ", offToStr(seg_start[i+1]), ", scanning sequentially\n");
+			closeWorkers(workers);
+			return false;
+		}
+		logg(V, "segment ", i, ": ", offToStr(lo), " - ", offToStr(hi), "\n");
+		parts.emplace_back(lo, hi);
+		if (premature >= 0) break;
+		lo = hi;
+	}
+
+	for (uint i=0; i < parts.size(); i++)
+		mergeSegment(*workers[i], parts[i].first, parts[i].second);
+	closeWorkers(workers);
+
+	if (premature >= 0) setPrematureEnd(premature);
+	return true;
+}
+
+/* Several mdats in the broken file: each one is scanned by its own worker, as an independent unit.
+   Offsets stay relative to the content of the first mdat. The bytes in between
+   (mdat headers, other atoms) are excluded, so all samples end up in one mdat.
+*/
+bool Mp4::scanMdats(const string& filename) {
+	if (single_threaded_ || use_offset_map_ || g_dump_repaired || stream_out_ || g_resume || g_range_start != kRangeUnset) return false;
+	auto parts = mdatContents();
+	if (parts.size() < 2) return false;
+
+	uint batch = g_threads > 1 ? g_threads : max(1u, thread::hardware_concurrency());
+	logg(I, "found ", parts.size(), " mdats, scanning them with ", min<size_t>(batch, parts.size()), " threads\n");
+
+	off_t done = 0;  // merged up to here
+	for (size_t b=0; b < parts.size(); b += batch) {
+		size_t e = min(parts.size(), b + batch);
+		auto orig_log_mode = g_log_mode;
+		g_log_mode = min(g_log_mode, W);
+		vector<unique_ptr<Mp4>> workers;
+		for (size_t i=b; i < e; i++) workers.push_back(newWorker(filename));
+
+		runWorkers(workers, [&](Mp4& w, int i) {
+			auto [start, stop] = parts[b+i];
+			w.current_mdat_->file_end_ = w.toAbsOff(stop);  // no sample may reach into the next mdat
+			w.scanSegment(start, stop, start);
+		});
+		g_log_mode = orig_log_mode;
+
+		for (size_t i=b; i < e; i++) {
+			auto& w = *workers[i-b];
+			auto [start, stop] = parts[i];
+			off_t hi = stop;
+			if (!g_ignore_unknown && w.fatal_unknowns_.size()) hi = w.fatal_unknowns_.front();
+
+			if (start > done) addToExclude(done, start - done, true);
+			logg(V, "mdat ", i, ": ", offToStr(start), " - ", offToStr(hi), "\n");
+			mergeSegment(w, start, hi);
+			done = hi;
+			if (hi == stop) continue;
+
+			if (i+1 == parts.size()) {
+				closeWorkers(workers);
+				setPrematureEnd(hi);
+				return true;
+			}
+			logg(W, "unknown sequence in mdat ", i, " at ", offToStr(hi), ", skipping the rest of it\n");
+			addToExclude(hi, stop - hi);
+			done = stop;
+		}
+		closeWorkers(workers);
+	}
+	return true;
+}
+
+// [start, end) of each mdat content, relative to the first one
+vector<pair<off_t, off_t>> Mp4::mdatContents() {
+	vector<pair<off_t, off_t>> r;
+	auto& mdat = *current_mdat_;
+	auto& f = mdat.file_read_;
+	off_t end = mdat.start_ + mdat.length_;
+	if (mdat.start_ < 0 || f.isStream() || mdat.length_ < mdat.header_length_ || end >= f.length()) return r;
+
+	off_t base = mdat.contentStart();
+	r.emplace_back(0, end - base);
+	for (off_t pos = end; pos + 8 <= f.length();) {
+		Atom a;
+		f.seek(pos);
+		a.parseHeader(f, true);
+		if (!isValidAtomName((const uchar*)a.name_.data()) || a.length_ < a.header_length_) break;
+		if (a.name_ == "mdat") r.emplace_back(a.contentStart() - base, min<off_t>(a.start_ + a.length_, f.length()) - base);
+		pos = a.start_ + a.length_;
+	}
+	r.back().second = mdat.contentSize();  // the last one might be truncated, anything behind it gets scanned as usual
+	return r;
+}
+
+// scans [start, stop), resyncs first if start is not known to be a frame boundary (lenient_end > start)
+void Mp4::scanSegment(off_t start, off_t stop, off_t lenient_end) {
+	off_t offset = start ? start : findStartOffset();
+	bool synced = lenient_end <= start;
+
+	while (true) {
+		if (offset >= stop) {
+			pushBackLastChunk();
+			chkUnknownSequenceEnded(offset);
+			break;
+		}
+		if (!chkOffset(offset)) break;
+		if (tryAll(offset)) {
+			synced = true;
+			continue;
+		}
+
+		if (!unknown_length_) {
+			pushBackLastChunk();
+			setLastTrackIdx(idx_free_);
+			if (synced) {
+				fatal_unknowns_.push_back(offset);
+				if (!g_ignore_unknown && offset >= lenient_end) break;
+			}
+		}
+
+		auto step = calcStep(offset);
+		step += resyncDistance(offset + step);
+		unknown_length_ += step;
+		offset += step;
+	}
+}
+
+unique_ptr<Mp4> Mp4::newWorker(const string& filename) {
+	auto w = cloneAnalyzed();
+	g_mp4 = w.get();
+	w->prepareRepair();
+	w->findMdat(w->openFile(filename));
+	for (auto& t : w->tracks_) t.clear();
+	g_mp4 = this;
+	return w;
+}
+
+unique_ptr<Mp4> Mp4::cloneAnalyzed() {
+	unique_ptr<Mp4> w(new Mp4);
+	g_mp4 = w.get();
+	w->parseOk(filename_ok_);
+	w->refs_ = refs_;
+	w->useReferences();
+	if (chunk_transitions_.size()) {  // genDynStats() ran
+		w->pattern_buffs_ = pattern_buffs_;
+		w->buffs_given_ = true;
+	}
+	w->can_skip_free_ = can_skip_free_;
+	g_mp4 = this;
+	return w;
+}
+
+// calls fn(worker, i) on one thread per worker, with ffmpeg muted
+void Mp4::runWorkers(vector<unique_ptr<Mp4>>& workers, const function<void(Mp4&, int)>& fn) {
+	bool was_muted = g_muted;
+	if (!was_muted) mute();
+
+	Options opts;
+	vector<thread> threads;
+	vector<exception_ptr> errors(workers.size());
+	for (uint i=0; i < workers.size(); i++) {
+		threads.emplace_back([&, i]() {
+			opts.apply();
+			g_mp4 = workers[i].get();
+			try {
+				fn(*workers[i], i);
+			}
+			catch (...) {
+				errors[i] = current_exception();
+			}
+		});
+	}
+	for (auto& t : threads) t.join();
+	for (auto& w : workers) {
+		if (!w->match_cache_) continue;
+		matchCache().hits_ += w->match_cache_->hits_;
+		matchCache().misses_ += w->match_cache_->misses_;
+	}
+
+	if (!was_muted) unmute();
+	for (auto& e : errors)
+		if (e) rethrow_exception(e);
+}
+
+void Mp4::closeWorkers(vector<unique_ptr<Mp4>>& workers) {
+	workers.clear();  // ~Mp4 closes their files
+}
+
+// first chunk start at or behind 'from', which 'next' found as well
+off_t Mp4::findSyncOffset(Mp4& next, off_t from) {
+	set<pair<off_t, int>> theirs;
+	for (uint i=0; i < next.tracks_.size(); i++) {
+		if (next.tracks_[i].is_dummy_) continue;
+		for (auto& c : next.tracks_[i].chunks_) theirs.emplace(c.off_, i);
+	}
+
+	off_t best = -1;
+	for (uint i=0; i < tracks_.size(); i++) {
+		if (tracks_[i].is_dummy_) continue;
+		for (auto& c : tracks_[i].chunks_) {
+			if (c.off_ < from) continue;
+			if (best >= 0 && c.off_ >= best) break;
+			if (theirs.count({c.off_, i})) best = c.off_;
+		}
+	}
+	return best;
+}
+
+void Mp4::mergeSegment(Mp4& w, off_t lo, off_t hi) {
+	auto inside = [&](off_t off) { return off >= lo && off < hi; };
+
+	int64_t w_excluded = 0;  // by w before lo
+	for (auto [start, len] : w.current_mdat_->sequences_to_exclude_)
+		if (start < lo) w_excluded += len;
+	int64_t shift = current_mdat_->total_excluded_yet_ - w_excluded;
+
+	for (auto [start, len] : w.current_mdat_->sequences_to_exclude_) {
+		if (!inside(start)) continue;
+		current_mdat_->sequences_to_exclude_.emplace_back(start, len);
+		current_mdat_->total_excluded_yet_ += len;
+	}
+	for (auto& x : w.unknown_seqs_) if (inside(x.first)) unknown_seqs_.push_back(x);
+	for (auto& x : w.atoms_skipped_) if (inside(x.first)) atoms_skipped_.push_back(x);
+
+	assert(w.tracks_.size() == tracks_.size());
+	for (uint i=0; i < tracks_.size(); i++) {
+		auto& src = w.tracks_[i];
+		auto& dst = tracks_[i];
+
+		size_t k0 = 0, k1 = 0;  // sample range
+		for (auto& c : src.chunks_) {
+			if (c.off_ < lo) k0 += c.n_samples_;
+			if (c.off_ < hi) k1 += c.n_samples_;
+			if (!inside(c.off_)) continue;
+			dst.chunks_.push_back(c);
+			dst.chunks_.back().already_excluded_ += shift;
+		}
+		if (src.is_dummy_) continue;
+		assert(k1 <= src.num_samples_, k1, src.num_samples_, src.codec_.name_);
+
+		size_t base = dst.num_samples_;
+		dst.num_samples_ += k1 - k0;
+		pkt_idx_ += k1 - k0;
+		if (src.sizes_.size())
+			dst.sizes_.insert(dst.sizes_.end(), src.sizes_.begin() + k0, src.sizes_.begin() + k1);
+		if (src.times_.size() > k0)
+			dst.times_.insert(dst.times_.end(), src.times_.begin() + k0, src.times_.begin() + min(k1, src.times_.size()));
+		for (auto k : src.keyframes_)
+			if (to_size_t(k) >= k0 && to_size_t(k) < k1) dst.keyframes_.push_back(base + k - k0);
+	}
+}
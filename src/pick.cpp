@@ -0,0 +1,172 @@
+#include <thread>
+#include <tuple>
+#include <iomanip>
+#include <sys/stat.h>
+
+#include "mp4.h"
+#include "atom.h"
+#include "file.h"
+#include "common.h"
+
+using namespace std;
+
+/* '-pick <dir>': chooses the healthy file (or profile) for a corrupt file out of a library.
+   Each candidate scans the start of the corrupt mdat, nothing gets repaired. Scored are
+   the bytes it can explain, how often its dynamic patterns hold at the track transitions
+   it found, whether its chunk grid (start_off_gcd_) fits the corrupt mdat and the ftyp brand.
+   Dynamic stats are always used here, so every candidate has patterns and a grid.
+*/
+
+struct PickScore {
+	bool ok = false;
+	double explained = 0;  // of the scanned window
+	double patterns = -1, grid = -1, brand = -1;  // -1 = not applicable
+	uint64_t samples = 0;
+
+	double total() const {
+		double sum = 2 * explained, n = 2;
+		for (auto x : {patterns, grid, brand})
+			if (x >= 0) sum += x, n++;
+		return sum / n;
+	}
+};
+
+namespace {
+constexpr int64_t kPickWindow = 2<<20;
+
+string readBrand(const string& filename) {
+	FileRead f(filename);
+	if (f.length() < 12) return "";
+	f.seek(4);
+	if (f.getString(4) != "ftyp") return "";
+	return f.getString(4);
+}
+
+bool looksLikeMp4(const string& filename) {
+	FileRead f(filename);
+	if (f.length() < 8) return false;
+	f.seek(4);
+	auto name = f.getString(4);
+	return isValidAtomName((const uchar*)name.data());
+}
+
+bool sameFile(const string& a, const string& b) {
+	struct stat sa, sb;
+	if (stat(a.c_str(), &sa) || stat(b.c_str(), &sb)) return false;
+	return sa.st_ino && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+}
+
+string pct(double x) {
+	return x < 0 ? "-" : ss(fixed, setprecision(0), 100 * x, "%");
+}
+}
+
+string Mp4::pickReference(const string& dir, const string& corrupt) {
+	if (!isdir(dir)) logg(ET, "'", dir, "' is not a directory\n");
+	vector<string> cands;
+	for (auto& fn : listDir(dir))
+		if (!sameFile(fn, corrupt) && looksLikeMp4(fn)) cands.push_back(fn);
+	if (cands.empty()) logg(ET, "no mp4 files or profiles found in '", dir, "'\n");
+
+	string brand = readBrand(corrupt);
+	uint batch = g_threads > 1 ? g_threads : max(1u, thread::hardware_concurrency());
+	logg(I, "ranking ", cands.size(), " candidates for '", corrupt, "' ...\n");
+
+	// errors must not end the process
+	auto saved = make_tuple(g_use_chunk_stats, g_interactive, g_throw_fatal, g_log_mode);
+	g_use_chunk_stats = g_throw_fatal = true;
+	g_interactive = false;
+	g_log_mode = min(g_log_mode, E);
+	// parseOk sets NAL and strictness flags, each candidate starts from a copy of these
+	Options base;
+
+	vector<PickScore> scores(cands.size());
+	for (size_t b=0; b < cands.size(); b += batch) {
+		size_t e = min(cands.size(), b + batch);
+		vector<unique_ptr<Mp4>> workers;
+		for (size_t i=b; i < e; i++) workers.emplace_back(new Mp4);
+
+		runWorkers(workers, [&](Mp4& m, int i) {
+			base.apply();
+			try {
+				m.parseOk(cands[b+i]);
+				m.prepareRepair();
+				m.findMdat(m.openFile(corrupt));
+				for (auto& t : m.tracks_) t.clear();
+				m.scoreAsReference(scores[b+i], brand);
+			}
+			catch (const exception&) {}
+			catch (const string&) {}
+			catch (const char*) {}
+		});
+		closeWorkers(workers);
+	}
+	tie(g_use_chunk_stats, g_interactive, g_throw_fatal, g_log_mode) = saved;
+
+	vector<size_t> order;
+	for (size_t i=0; i < cands.size(); i++) {
+		if (scores[i].ok) order.push_back(i);
+		else logg(W, "could not use '", cands[i], "'\n");
+	}
+	if (order.empty()) logg(ET, "none of the files in '", dir, "' can be used\n");
+	stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+		return scores[a].total() > scores[b].total();
+	});
+
+	cout << "\n" << setw(7) << "score" << setw(10) << "explained" << setw(10) << "patterns"
+	     << setw(7) << "grid" << setw(7) << "ftyp" << setw(9) << "samples" << "  file\n";
+	for (auto i : order) {
+		auto& s = scores[i];
+		cout << setw(7) << pct(s.total()) << setw(10) << pct(s.explained) << setw(10) << pct(s.patterns)
+		     << setw(7) << pct(s.grid) << setw(7) << pct(s.brand) << setw(9) << s.samples << "  " << cands[i] << '\n';
+	}
+	cout << '\n';
+
+	auto& best = cands[order.front()];
+	logg(I, "using '", best, "'\n");
+	return best;
+}
+
+// expects a fresh scan state, with the corrupt file opened
+void Mp4::scoreAsReference(PickScore& s, const string& corrupt_brand) {
+	off_t window = min<off_t>(kPickWindow, current_mdat_->contentSize());
+	if (window <= 0) return;
+	scanSegment(0, window, 0);
+
+	off_t end = window;
+	if (!g_ignore_unknown && fatal_unknowns_.size()) end = min(end, fatal_unknowns_.front());
+	int64_t unknown = 0;
+	for (auto& [off, len] : unknown_seqs_)
+		if (off < end) unknown += min<int64_t>(len, end - off);
+	s.explained = max<double>(0, end - unknown) / window;
+	s.samples = pkt_idx_;
+
+	vector<pair<off_t, int>> chunks;
+	for (uint i=0; i < tracks_.size(); i++)
+		for (auto& c : tracks_[i].chunks_) chunks.emplace_back(c.off_, i);
+	sort(chunks.begin(), chunks.end());
+	int n = 0, hits = 0;
+	for (uint i=1; i < chunks.size(); i++) {
+		auto [off, idx] = chunks[i];
+		auto& prev = tracks_[chunks[i-1].second];
+		if (idx == chunks[i-1].second || to_size_t(idx) >= prev.dyn_patterns_.size() || prev.dyn_patterns_[idx].empty()) continue;
+		auto buff = getBuffAround(off, pat_size_);
+		if (!buff) continue;
+		n++;
+		hits += prev.doesMatchTransition(buff, idx);
+	}
+	if (n) s.patterns = (double)hits / n;
+
+	// chunk offsets are multiples of start_off_gcd_ in the healthy file, the corrupt mdat has to be aligned alike
+	auto ok_mdat = root_atom_->atomByName("mdat", true);
+	n = hits = 0;
+	for (auto& t : tracks_) {
+		if (t.is_dummy_ || !ok_mdat || t.start_off_gcd_ <= 1) continue;
+		n++;
+		hits += (current_mdat_->contentStart() - ok_mdat->contentStart()) % t.start_off_gcd_ == 0;
+	}
+	if (n) s.grid = (double)hits / n;
+
+	if (ftyp_.size() && corrupt_brand.size()) s.brand = ftyp_ == corrupt_brand;
+	s.ok = true;
+}
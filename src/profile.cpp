@@ -0,0 +1,108 @@
+#include <string.h>
+
+#include "mp4.h"
+#include "atom.h"
+#include "file.h"
+#include "common.h"
+#include "checkpoint.h"
+
+using namespace std;
+
+/* '-save-profile <file>' keeps what a repair needs from the healthy file: ftyp and moov
+   (codec configs, sample tables), the mdat positions and the results of the analysis
+   steps that read mdat content (buffers for the dynamic patterns, canSkipFree()).
+   A profile is an mp4 without mdat, the rest is stored in a 'free' atom. It can be used
+   instead of the healthy file, so ffmpeg only parses the moov and nothing else of the
+   healthy file is read. Stats derived from the sample tables are recomputed.
+*/
+
+namespace {
+constexpr uint32_t kProfileVersion = 1;
+const string kProfileMagic = "untrunc-profile";
+}
+
+void Mp4::saveProfile(const string& path) {
+	if (from_profile_) logg(ET, "'", filename_ok_, "' already is a profile\n");
+	if (refs_.size()) logg(ET, "'-save-profile' can't be combined with '-ref'\n");
+	genDynStats();  // might not be needed for every repair, but is cheap to keep
+
+	vector<uchar> out;
+	vector<pair<string, int64_t>> starts;
+	vector<pair<int64_t, int64_t>> mdats;
+	vector<int64_t> mdat_header_lengths;
+	for (auto atom : root_atom_->children_) {
+		if (atom->name_ == "mdat") {
+			mdats.emplace_back(atom->start_, atom->length_);
+			mdat_header_lengths.push_back(atom->header_length_);
+		}
+		else if (contains({"ftyp", "moov"}, atom->name_)) {
+			starts.emplace_back(atom->name_, atom->start_);
+			atom->serialize(out);
+		}
+	}
+
+	BinWriter w;
+	w.put(kProfileMagic);
+	w.put(kProfileVersion);
+	w.put(getMovExtension(filename_ok_));
+	w.put(starts);
+	w.put(mdats);
+	w.put(mdat_header_lengths);
+	w.put(can_skip_free_);
+	w.put(vector<pair<pair<int, int>, pair<buffs_t, buffs_t>>>(pattern_buffs_.begin(), pattern_buffs_.end()));
+
+	uint free_len = swap32(8 + w.buf_.size());
+	out.insert(out.end(), (uchar*)&free_len, (uchar*)&free_len + 4);
+	out.insert(out.end(), {'f', 'r', 'e', 'e'});
+	out.insert(out.end(), w.buf_.begin(), w.buf_.end());
+
+	if (!writeFileAtomically(path, out)) logg(ET, "could not write profile '", path, "'\n");
+	logg(I, "saved profile of '", filename_ok_, "' to '", path, "' (", pretty_bytes(out.size()), ")\n");
+}
+
+bool Mp4::loadProfile(Atom* atom) {
+	auto& c = atom->content_;
+	if (c.size() < 8 + kProfileMagic.size() || memcmp(c.data() + 8, kProfileMagic.data(), kProfileMagic.size()))
+		return false;
+
+	vector<pair<string, int64_t>> starts;
+	vector<pair<int64_t, int64_t>> mdats;
+	vector<int64_t> mdat_header_lengths;
+	vector<pair<pair<int, int>, pair<buffs_t, buffs_t>>> buffs;
+	try {
+		BinReader r(c.data(), c.size());
+		r.get<string>();
+		if (r.get<uint32_t>() != kProfileVersion)
+			throw string("it was made by a different version of untrunc, save it again");
+		r.get(ok_ext_);
+		r.get(starts);
+		r.get(mdats);
+		r.get(mdat_header_lengths);
+		r.get(can_skip_free_);
+		r.get(buffs);
+		if (!r.atEnd() || mdats.size() != mdat_header_lengths.size()) throw string("corrupt data");
+	}
+	catch (const string& e) {
+		logg(ET, "can't use profile '", filename_ok_, "': ", e, "\n");
+	}
+
+	root_atom_->prune(atom);
+	for (auto& [name, start] : starts) {
+		auto a = root_atom_->atomByName(name, true);
+		if (a) a->start_ = start;  // chunk offsets are relative to the healthy file
+	}
+	for (uint i=0; i < mdats.size(); i++) {
+		auto mdat = new Atom;
+		mdat->name_ = "mdat";
+		tie(mdat->start_, mdat->length_) = mdats[i];
+		mdat->header_length_ = mdat_header_lengths[i];
+		root_atom_->children_.push_back(mdat);
+	}
+	auto& ch = root_atom_->children_;
+	stable_sort(ch.begin(), ch.end(), [](Atom* a, Atom* b) { return a->start_ < b->start_; });
+
+	pattern_buffs_ = decltype(pattern_buffs_)(buffs.begin(), buffs.end());
+	from_profile_ = buffs_given_ = true;
+	logg(V, "loaded profile, mdats: ", mdats.size(), ", transitions: ", pattern_buffs_.size(), "\n");
+	return true;
+}
@@ -0,0 +1,84 @@
+#include <map>
+
+#include "mp4.h"
+#include "atom.h"
+#include "file.h"
+#include "common.h"
+
+using namespace std;
+
+/* '-ref <file>': more healthy files of the same camera, for tighter stats.
+   Each one is parsed on its own thread. Sample size stats are merged (see SSTats::merge),
+   genLikely() combines the histograms of all files and the dynamic patterns are
+   generated from the buffers of all files, so a pattern has to hold in each of them.
+*/
+void Mp4::addReferences(const vector<string>& filenames) {
+	logg(I, "parsing ", filenames.size(), " more healthy files ...\n");
+	bool need_dyn_stats = needDynStats();
+
+	auto orig_log_mode = g_log_mode;
+	g_log_mode = min(g_log_mode, W);
+	vector<unique_ptr<Mp4>> refs;
+	for (uint i=0; i < filenames.size(); i++) refs.emplace_back(new Mp4);
+	runWorkers(refs, [&](Mp4& r, int i) {
+		r.parseOk(filenames[i]);
+		if (need_dyn_stats) r.genDynStats();  // only keeps the buffers it read
+	});
+	g_log_mode = orig_log_mode;
+	for (auto& r : refs) {
+		r->closeFiles();  // only their stats are needed
+		refs_.emplace_back(move(r));
+	}
+	useReferences();
+
+	for (uint k=0; k < refs_.size(); k++) {
+		auto& m = ref_track_idx_[k];
+		for (uint i=0; i < m.size(); i++)
+			if (m[i] < 0) logg(W, "'", filenames[k], "' has no '", tracks_[i].codec_.name_, "' track\n");
+	}
+	if (logEnabled(V)) printStats();
+}
+
+// matches tracks by codec (and occurrence), merges their stats
+void Mp4::useReferences() {
+	ref_track_idx_.clear();
+	for (auto& r : refs_) {
+		vector<int> m;
+		map<string, int> seen;
+		for (auto& t : tracks_) {
+			int k = seen[t.codec_.name_]++, idx = -1;
+			for (uint j=0; j < r->tracks_.size(); j++) {
+				auto& rt = r->tracks_[j];
+				if (rt.is_dummy_ || rt.codec_.name_ != t.codec_.name_ || k--) continue;
+				idx = j;
+				break;
+			}
+			m.push_back(idx);
+		}
+		ref_track_idx_.push_back(m);
+	}
+
+	for (uint i=0; i < tracks_.size(); i++) {
+		auto& t = tracks_[i];
+		for (uint k=0; k < refs_.size(); k++) {
+			int j = ref_track_idx_[k][i];
+			if (j < 0) continue;
+			auto& rt = refs_[k]->tracks_[j];
+			t.ss_stats_.merge(rt.ss_stats_);
+			t.extra_refs_.push_back(&rt);
+		}
+		if (g_max_partsize <= 0) max_part_size_ = max(max_part_size_, t.ss_stats_.maxAllowedPktSz());
+	}
+}
+
+void Mp4::addRefPatternBuffs(pair<int, int> transition, pair<buffs_t, buffs_t>& buffs) {
+	for (uint k=0; k < refs_.size(); k++) {
+		auto& r = *refs_[k];
+		auto refIdx = [&](int i) { return i == idx_free_ ? r.idx_free_ : ref_track_idx_[k][i]; };
+		auto it = r.pattern_buffs_.find({refIdx(transition.first), refIdx(transition.second)});
+		if (it == r.pattern_buffs_.end()) continue;
+		auto& [a, b] = it->second;
+		buffs.first.insert(buffs.first.end(), a.begin(), a.end());
+		buffs.second.insert(buffs.second.end(), b.begin(), b.end());
+	}
+}
@@ -0,0 +1,95 @@
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "mp4.h"
+#include "atom.h"
+#include "common.h"
+
+using namespace std;
+
+/* Inside an unknown sequence (without chunk stats), an offset is only left by the
+   normal path if one of these holds for its first 8 bytes:
+     - a track's match function accepts it (supported tracks are strict there), see CodecSig
+     - skipZeros: 4 zero bytes
+     - skipAtoms/skipAtomHeaders: valid atom name at +4
+   resyncDistance() tests a whole fragment for this, so that only these offsets reach tryAll().
+*/
+
+namespace {
+
+struct Resync {
+	vector<const CodecSig*> sigs;
+	bool first_[256] = {};  // start[0] could be a hit
+	vector<uchar> first_vals;
+
+	bool isHit(const uchar* p) const {
+		if (*(uint*)p == 0 || isValidAtomName(p+4)) return true;
+		if (!first_[p[0]]) return false;
+		for (auto sig : sigs) if (sig->matches(p)) return true;
+		return false;
+	}
+};
+
+bool isAtomStart(uchar c) { return (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9'); }
+
+#ifdef __SSE2__
+// bit i: p[i] is one of vals or p[i+4] is [a-z0-9]
+inline uint candidates16(const uchar* p, const vector<uchar>& vals) {
+	__m128i v0 = _mm_loadu_si128((const __m128i*)p);
+	__m128i v4 = _mm_loadu_si128((const __m128i*)(p+4));
+	__m128i m = _mm_setzero_si128();
+	for (auto x : vals) m = _mm_or_si128(m, _mm_cmpeq_epi8(v0, _mm_set1_epi8(x)));
+	auto in_range = [](__m128i v, char lo, char n) {  // lo <= v < lo+n, unsigned
+		__m128i d = _mm_sub_epi8(v, _mm_set1_epi8(lo));
+		return _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(n-1)), d);
+	};
+	m = _mm_or_si128(m, in_range(v4, 'a', 26));
+	m = _mm_or_si128(m, in_range(v4, '0', 10));
+	return _mm_movemask_epi8(m);
+}
+#endif
+
+}  // namespace
+
+int64_t Mp4::resyncDistance(off_t offset) {
+	if (g_use_chunk_stats || use_offset_map_) return 0;
+	if (idx_free_ > 0 && dummy_do_padding_skip_) return 0;
+	if (pkt_idx_ == 4 && hasCodec("tmcd") && getTrack("tmcd").is_tmcd_hardcoded_) return 0;
+
+	Resync r;
+	for (auto& t : tracks_) {
+		if (!t.codec_.canMatch()) continue;
+		auto& sig = t.isSupported() ? t.codec_.strict_sig_ : t.codec_.sig_;  // see shouldBeStrict
+		if (sig.isTrivial()) return 0;
+		r.sigs.push_back(&sig);
+		for (uint b=0; b < 256; b++) r.first_[b] |= sig.allowsFirst(b);
+	}
+	r.first_[0] = true;  // skipZeros
+	for (uint b=0; b < 256; b++) if (r.first_[b]) r.first_vals.push_back(b);
+
+	constexpr int kTail = 64;  // last bytes are left to the normal path
+	auto avail = min((int64_t) g_max_buf_sz_needed, current_mdat_->contentSize() - offset);
+	if (avail <= kTail) return 0;
+	auto buff = loadFragment(offset, false);
+	int64_t end = avail - kTail;
+
+	int64_t i = 0;
+#ifdef __SSE2__
+	if (Mp4::step_ == 1 && r.first_vals.size() <= 8) {
+		for (; i + 16 <= end; i += 16) {
+			for (uint m = candidates16(buff + i, r.first_vals); m; m &= m - 1) {
+				auto j = i + __builtin_ctz(m);
+				if (r.isHit(buff + j)) return j;
+			}
+		}
+	}
+#endif
+	for (; i < end; i += Mp4::step_) {
+		auto p = buff + i;
+		if ((r.first_[p[0]] || isAtomStart(p[4])) && r.isHit(p)) return i;
+	}
+	return i;
+}
@@ -30,6 +30,36 @@ bool isPointingAtRtmdHeader(FileRead& file) {
 	return isRtmdHeader(file.getPtr(12));
 }
 
+// points into the mapping if possible, else reads into a buffer limited by '-mem'
+class RsvWindow {
+public:
+	RsvWindow(FileRead& file, size_t wanted) : file_(file), size_(wanted) {
+		if (file_.isMapped()) return;
+		size_ = memTake(wanted, 32 * 1024 * 1024, "rsv buffer");
+		buffer_.resize(size_);
+	}
+	~RsvWindow() { if (buffer_.size()) memGive(size_); }
+
+	size_t load(off_t off) {
+		size_t n = min((off_t)size_, file_.length() - off);
+		if (file_.isMapped()) {
+			data_ = file_.getFragment(off, n);
+		} else {
+			file_.seek(off);
+			file_.readChar((char*)buffer_.data(), n);
+			data_ = buffer_.data();
+		}
+		return n;
+	}
+	const uchar* data() const { return data_; }
+
+private:
+	FileRead& file_;
+	size_t size_;
+	std::vector<uchar> buffer_;
+	const uchar* data_ = nullptr;
+};
+
 // RSV file repair (Ben's method) - processes GOP-based structure
 // For more details see:
 // https://github.com/anthwlock/untrunc/pull/254
@@ -137,10 +167,8 @@ void Mp4::repairRsvBen(const string& filename) {
 
 	// Auto-detect RSV structure parameters from the file itself
 	{
-		vector<uchar> detect_buf(128 * 1024 * 1024);  // 128MB buffer for detection (GOPs can be 25MB+ at high bitrates)
-		file_read.seek(0);
-		size_t detect_read = min((off_t)detect_buf.size(), file_size);
-		file_read.readChar((char*)detect_buf.data(), detect_read);
+		RsvWindow detect_buf(file_read, 128 * 1024 * 1024);  // 128MB for detection (GOPs can be 25MB+ at high bitrates)
+		size_t detect_read = detect_buf.load(0);
 
 		// First, detect rtmd_packet_size by finding distance between first two rtmd patterns
 		off_t first_rtmd = -1, second_rtmd = -1;
@@ -231,8 +259,7 @@ void Mp4::repairRsvBen(const string& filename) {
 	int total_rtmd_packets = 0;
 
 	// Buffer for reading
-	const size_t buf_size = 128 * 1024 * 1024;  // 128MB buffer (GOPs can be 25MB+ at high bitrates)
-	vector<uchar> buffer(buf_size);
+	RsvWindow buffer(file_read, 128 * 1024 * 1024);  // 128MB (GOPs can be 25MB+ at high bitrates)
 
 	while (pos < file_size) {
 		// First, count rtmd packets to skip past them
@@ -260,9 +287,7 @@ void Mp4::repairRsvBen(const string& filename) {
 		logg(V, "GOP ", gop_count, ": rtmd at ", pos, " (", rtmd_count, " packets), video starts at ", video_start, "\n");
 
 		// Read buffer starting from video_start for frame detection
-		file_read.seek(video_start);
-		size_t to_read = min((off_t)buf_size, file_size - video_start);
-		file_read.readChar((char*)buffer.data(), to_read);
+		size_t to_read = buffer.load(video_start);
 
 		// Find all video frames by searching for AUD patterns
 		// Use memchr for fast first-byte search, then verify remaining bytes
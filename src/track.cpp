@@ -665,16 +665,23 @@ bool Track::dummyIsUsedAsPadding() {
 void Track::genLikely() {
 	if (likely_n_samples_.size()) return;  // already done
 	assert(sizes_.size() > 0 || constant_size_);
+	vector<const Track*> refs = {this};  // histograms are combined
+	refs.insert(refs.end(), extra_refs_.begin(), extra_refs_.end());
 
 	if (sizes_.size() > 1) {
 		random_device rd;
 		mt19937 mt(rd());
-		auto dis = uniform_int_distribution<size_t>(0, sizes_.size()-2);
 		map<int, int> sizes_cnt;
-		int n_sample = min(to_size_t(500), sizes_.size());
-		for (int n=n_sample; n--;) {
-			auto idx = dis(mt);
-			sizes_cnt[sizes_[idx]]++;
+		int n_sample = 0;
+		for (auto t : refs) {
+			if (t->sizes_.size() < 2) continue;
+			auto dis = uniform_int_distribution<size_t>(0, t->sizes_.size()-2);
+			int n_t = min(to_size_t(500), t->sizes_.size());
+			for (int n=n_t; n--;) {
+				auto idx = dis(mt);
+				sizes_cnt[t->sizes_[idx]]++;
+			}
+			n_sample += n_t;
 		}
 
 		for (auto& kv : sizes_cnt) {
@@ -700,10 +707,15 @@ void Track::genLikely() {
 	assert(chunks_.size());
 
 	map<int, int> cnts;
-	for (size_t i=0; i < chunks_.size() - 1; i++) cnts[chunks_[i].n_samples_]++;
+	size_t n_chunks = 0;
+	for (auto t : refs) {
+		if (t->chunks_.empty()) continue;
+		for (size_t i=0; i < t->chunks_.size() - 1; i++) cnts[t->chunks_[i].n_samples_]++;
+		n_chunks += t->chunks_.size() - 1;
+	}
 	for (auto& kv : cnts) {
 		auto n_samples = kv.first, cnt = kv.second;
-		auto p = (double)cnt / (chunks_.size()-1);
+		auto p = (double)cnt / n_chunks;
 		if (cnts.size() <= 3 || p >= 0.2) {
 			likely_n_samples_.push_back(n_samples);
 			likely_n_samples_p += p;
@@ -718,10 +730,15 @@ void Track::genLikely() {
 
 		start_off_gcd_ = chunks_[0].off_;  // these offsets are absolute (to file begin)
 		end_off_gcd_ = chunks_[0].off_ + chunks_[0].size_;
-		for (auto& c : chunks_) {
-			off_t end_off = c.off_ + c.size_;
-			start_off_gcd_ = gcd(start_off_gcd_, c.off_);
-			end_off_gcd_ = gcd(end_off_gcd_, end_off);
+		for (auto t : refs) {
+			for (uint i=1; t != this && i < t->chunks_.size(); i++) {
+				chunk_distance_gcd_ = gcd(chunk_distance_gcd_, t->chunks_[i].off_ - t->chunks_[i-1].off_);
+			}
+			for (auto& c : t->chunks_) {
+				off_t end_off = c.off_ + c.size_;
+				start_off_gcd_ = gcd(start_off_gcd_, c.off_);
+				end_off_gcd_ = gcd(end_off_gcd_, end_off);
+			}
 		}
 	}
 	else {
@@ -736,7 +753,7 @@ int Track::useDynPatterns(off_t offset) {
 	if (!buff) return -1;
 
 	for (uint i=0; i < dyn_patterns_perm_.size(); i++) {
-		if (i == to_uint(use_looks_like_twos_idx_) && Codec::looksLikeTwosOrSowt(buff + Mp4::pat_size_ / 2)) {
+		if (i == to_uint(use_looks_like_twos_idx_) && Codec::looksLikeTwosOrSowt(buff + Mp4::pat_size_ / 2, g_mp4->twos_is_sowt_)) {
 			logg(V, "looksLikeTwos: ", codec_.name_, "_", g_mp4->getCodecName(g_mp4->twos_track_idx_), "\n");
 			return g_mp4->twos_track_idx_;
 		}
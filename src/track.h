@@ -46,6 +46,23 @@ struct SSTats {
 		max = std::max(max, sz);
 	};
 
+	// parallel variant of Welford's method (Chan et al.), for '-ref'
+	void merge(const SSTats& o) {
+		if (!o.n) return;
+		if (!n) {
+			*this = o;
+			return;
+		}
+		uint64_t n_ab = n + o.n;
+		double delta = o.avg - avg;
+		avg += delta * o.n / n_ab;
+		m2 += o.m2 + delta * delta * ((double)n * o.n / n_ab);
+		n = n_ab;
+
+		min = std::min(min, o.min);
+		max = std::max(max, o.max);
+	}
+
 	void onFinished() {
 		if (!n) {
 			min = 0;
@@ -118,6 +135,12 @@ struct SampleSizeStats {
 		}
 	}
 
+	void merge(const SampleSizeStats& o) {
+		normal.merge(o.normal);
+		keyframe.merge(o.keyframe);
+		onFinished();
+	}
+
 	void onConstant(int sz) {
 		normal.onConstant(sz);
 		keyframe.onConstant(sz);
@@ -299,6 +322,7 @@ public:
 	void printStats();
 	void printDynPatterns(bool show_percentage=false);
 	void genLikely();
+	std::vector<const Track*> extra_refs_;  // same track in other healthy files ('-ref')
 	bool isSupported() {
 		return codec_.isSupported() || is_tmcd_hardcoded_;
 	}
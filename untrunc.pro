@@ -9,6 +9,7 @@ QT -= gui
 
 TARGET = untrunc
 CONFIG += console
+CONFIG += thread
 CONFIG -= -qt app_bundle
 CONFIG += debug
 